@@ -0,0 +1,100 @@
+//
+
+#include "audio.h"
+
+#include <cstring>
+
+audio::audio (std::vector<uint8_t>&& bytes)
+{
+    std::shared_ptr<std::vector<uint8_t>> v = std::make_shared<std::vector<uint8_t>> (std::move (bytes));
+    _data = v->data ();
+    _len = v->size ();
+    _owner = v;
+}
+
+audio::audio (std::string&& bytes)
+{
+    std::shared_ptr<std::string> s = std::make_shared<std::string> (std::move (bytes));
+    _data = (const uint8_t*)s->data ();
+    _len = s->size ();
+    _owner = s;
+}
+
+audio::audio (const uint8_t* bytes, size_t len, std::shared_ptr<const void> owner)
+    : _data (bytes), _len (len), _owner (owner)
+{
+}
+
+// least significant first
+static void
+put_le (uint8_t* p, uint32_t val, int n)
+{
+    for (int i = 0; i < n; i++, val >>= 8) p[i] = val & 0xff;
+}
+
+static uint32_t
+get_le (const uint8_t* p, int n)
+{
+    uint32_t val = 0;
+    for (int i = n - 1; i >= 0; i--) val = (val << 8) | p[i];
+    return val;
+}
+
+void
+wav_header (uint8_t* hd, const wav_format& fmt, size_t datalen)
+{
+    const int block = fmt.channels * fmt.bits / 8;
+
+    memcpy (hd, "RIFF", 4);
+    put_le (hd + 4, datalen + 36, 4);
+    memcpy (hd + 8, "WAVEfmt ", 8);
+    put_le (hd + 16, 16, 4);			// fmt chunk size
+    put_le (hd + 20, 1, 2);			// PCM
+    put_le (hd + 22, fmt.channels, 2);
+    put_le (hd + 24, fmt.rate, 4);
+    put_le (hd + 28, fmt.rate * block, 4);	// byte rate
+    put_le (hd + 32, block, 2);
+    put_le (hd + 34, fmt.bits, 2);
+    memcpy (hd + 36, "data", 4);
+    put_le (hd + 40, datalen, 4);
+}
+
+int
+wav_parse (const uint8_t* wav, size_t len, wav_format& fmt, size_t* offset, size_t* datalen)
+{
+    if (!wav || len < 12) return -1;
+    if (strncmp ((const char*)wav, "RIFF", 4) != 0) return -1;
+    if (strncmp ((const char*)wav + 8, "WAVE", 4) != 0) return -1;
+
+    // chunks: id (4), size (4), body (padded to an even size); "fmt " comes before "data"
+    bool found = false;
+    for (size_t pos = 12; pos + 8 <= len; )
+    {
+        const uint8_t* chunk = wav + pos;
+        const size_t size = get_le (chunk + 4, 4);
+        const size_t body = pos + 8;
+
+        if (!strncmp ((const char*)chunk, "fmt ", 4))
+        {
+            if (size < 16 || body + 16 > len) return -1;
+            const uint32_t tag = get_le (chunk + 8, 2);
+            // PCM, or WAVE_FORMAT_EXTENSIBLE of PCM
+            if (tag != 1 && !(tag == 0xfffe && size >= 40 && body + 26 <= len && get_le (chunk + 32, 2) == 1)) return -1;
+            fmt.channels = get_le (chunk + 10, 2);
+            fmt.rate = get_le (chunk + 12, 4);
+            fmt.bits = get_le (chunk + 22, 2);
+            if (fmt.bits != 8 && fmt.bits != 16) return -1;
+            found = true;
+        }
+        else if (!strncmp ((const char*)chunk, "data", 4))
+        {
+            if (!found) return -1;
+            // the size may be left unset (0 or ~0) by a writer that streams: up to the end then
+            if (offset) *offset = body;
+            if (datalen) *datalen = (size == 0 || body + size > len) ? len - body : size;
+            return 0;
+        }
+        pos = body + size + (size & 1);
+    }
+    return -1;
+}
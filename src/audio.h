@@ -0,0 +1,50 @@
+//
+
+#ifndef TTS_AUDIO_H
+#define TTS_AUDIO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// synthesized speech in memory (RIFF/WAV), shared by the sinks of a request
+// the bytes are immutable once created, and are kept alive by the owner.
+class audio
+{
+public:
+    // takes over the storage (no copy)
+    audio (std::vector<uint8_t>&& bytes);
+    audio (std::string&& bytes);
+    // bytes owned by somebody else (e.g. malloc'd or mapped memory)
+    audio (const uint8_t* bytes, size_t len, std::shared_ptr<const void> owner);
+
+    const uint8_t* data () const { return _data; }
+    size_t size () const { return _len; }
+
+private:
+    const uint8_t* _data;
+    size_t _len;
+    std::shared_ptr<const void> _owner;
+};
+
+typedef std::shared_ptr<const audio> audio_ptr;
+
+// WAV header (http://soundfile.sapp.org/doc/WaveFormat/)
+struct wav_format
+{
+    int rate;		// sampling rate (Hz)
+    int channels;
+    int bits;		// bits per sample (8 | 16)
+};
+
+const size_t WAV_HEADER_SIZE = 44;
+
+// hd[0..43] <- header for 'datalen' bytes of PCM samples
+void wav_header (uint8_t* hd, const wav_format& fmt, size_t datalen);
+// header -> fmt, and where the samples are: wav[offset .. offset + datalen) (returns -1 when not a PCM WAV)
+// the chunks are walked (headers are not always the canonical 44 bytes, e.g. with a LIST chunk)
+int wav_parse (const uint8_t* wav, size_t len, wav_format& fmt, size_t* offset = nullptr, size_t* datalen = nullptr);
+
+#endif
@@ -0,0 +1,100 @@
+//
+
+#include "audio_cache.h"
+#include "logger.h"
+
+audio_cache::audio_cache (size_t capacity)
+    : _capacity (capacity), _size (0), _hits (0), _misses (0), _evictions (0)
+{
+}
+
+// conf = {"memory_mb": 32}
+int
+audio_cache::configure (const nlohmann::json& conf)
+{
+    syslog (LOG_NOTICE, "[audio_cache] %s", conf.dump().c_str());
+    if (!conf.is_object ()) return -1;
+
+    std::unique_lock<std::mutex> lock (_mutex);
+
+    if (conf.find ("memory_mb") != conf.end ())
+    {
+        const nlohmann::json mb = conf["memory_mb"];
+        if (!mb.is_number () || mb.get<double>() < 0)
+        {
+            syslog (LOG_ERR, "[audio_cache] invalid memory_mb: %s", mb.dump().c_str());
+            return -1;
+        }
+        _capacity = (size_t)(mb.get<double>() * 1024 * 1024);
+    }
+
+    return 0;
+}
+
+audio_ptr
+audio_cache::find (const std::string& key)
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    if (_capacity == 0) return nullptr;
+
+    std::unordered_map<std::string, std::list<entry>::iterator>::iterator it = _index.find (key);
+    if (it == _index.end ())
+    {
+        _misses++;
+        return nullptr;
+    }
+
+    // -> most recently used
+    _lru.splice (_lru.begin (), _lru, it->second);
+    _hits++;
+    return it->second->second;
+}
+
+void
+audio_cache::insert (const std::string& key, const audio_ptr& wav)
+{
+    if (!wav) return;
+
+    std::list<entry> evicted;  // destroyed outside the lock
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        if (wav->size () > _capacity) return;  // too large (or disabled)
+
+        // replaces the existing one, if any
+        std::unordered_map<std::string, std::list<entry>::iterator>::iterator it = _index.find (key);
+        if (it != _index.end ())
+        {
+            _size -= it->second->second->size ();
+            evicted.splice (evicted.end (), _lru, it->second);
+            _index.erase (it);
+        }
+
+        // evicts the least recently used ones
+        while (_size + wav->size () > _capacity && !_lru.empty ())
+        {
+            _size -= _lru.back().second->size ();
+            _index.erase (_lru.back().first);
+            evicted.splice (evicted.end (), _lru, std::prev (_lru.end ()));
+            _evictions++;
+        }
+
+        _lru.push_front (entry (key, wav));
+        _index[key] = _lru.begin ();
+        _size += wav->size ();
+    }
+}
+
+nlohmann::json
+audio_cache::stats () const
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+
+    nlohmann::json s;
+    s["capacity"] = _capacity;
+    s["size"] = _size;
+    s["entries"] = _lru.size ();
+    s["hits"] = _hits;
+    s["misses"] = _misses;
+    s["evictions"] = _evictions;
+    return s;
+}
@@ -0,0 +1,48 @@
+//
+
+#ifndef TTS_AUDIO_CACHE_H
+#define TTS_AUDIO_CACHE_H
+
+#include "audio.h"
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <nlohmann/json.hpp>
+
+// LRU cache of synthesized speech (wav), bounded by the total bytes of the entries
+// key = synthesizer name + request::key ()
+class audio_cache
+{
+public:
+    audio_cache (size_t capacity = 0);
+
+    // conf = {memory_mb}
+    int configure (const nlohmann::json& conf);
+    bool enabled () const { return _capacity > 0; }
+
+    audio_ptr find (const std::string& key);			// nullptr on miss
+    void insert (const std::string& key, const audio_ptr& wav);
+
+    nlohmann::json stats () const;
+
+private:
+    typedef std::pair<std::string, audio_ptr> entry;
+
+    size_t _capacity;		// bytes (0 = disabled)
+    size_t _size;		// bytes in use
+
+    std::list<entry> _lru;	// most recently used first
+    std::unordered_map<std::string, std::list<entry>::iterator> _index;
+    mutable std::mutex _mutex;
+
+    // counters
+    uint64_t _hits;
+    uint64_t _misses;
+    uint64_t _evictions;
+};
+
+#endif
@@ -0,0 +1,134 @@
+//
+
+#include "audio_stream.h"
+
+#include <cstring>
+
+audio_stream::audio_stream ()
+    : _fmt { 0, 0, 0 }, _opened (false), _closed (false), _err (0), _len (0)
+{
+}
+
+void
+audio_stream::open (const wav_format& fmt)
+{
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _fmt = fmt;
+        _opened = true;
+    }
+    _cv.notify_all ();
+}
+
+int
+audio_stream::write (const uint8_t* pcm, size_t len)
+{
+    if (len == 0) return 0;
+    return write (std::make_shared<audio> (std::vector<uint8_t> (pcm, pcm + len)));
+}
+
+int
+audio_stream::write (const audio_ptr& pcm)
+{
+    if (!pcm || pcm->size () == 0) return 0;
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        if (!_opened || _closed) return -1;
+        _chunks.push_back (pcm);
+        _len += pcm->size ();
+    }
+    _cv.notify_all ();
+    return 0;
+}
+
+void
+audio_stream::close (int err)
+{
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        if (_closed) return;
+        _closed = true;
+        _err = err;
+    }
+    _cv.notify_all ();
+}
+
+int
+audio_stream::wait ()
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    _cv.wait (lock, [this]() { return _closed; });
+    return _err;
+}
+
+audio_ptr
+audio_stream::wav ()
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    _cv.wait (lock, [this]() { return _closed; });
+    if (_err || !_opened) return nullptr;
+    if (_whole) return _whole;
+
+    // header + chunks
+    std::vector<uint8_t> bytes (WAV_HEADER_SIZE + _len);
+    wav_header (bytes.data (), _fmt, _len);
+    size_t pos = WAV_HEADER_SIZE;
+    for (const audio_ptr& c : _chunks)
+    {
+        memcpy (bytes.data () + pos, c->data (), c->size ());
+        pos += c->size ();
+    }
+    return std::make_shared<audio> (std::move (bytes));
+}
+
+int
+audio_stream::feed (audio_stream& out, const audio_ptr& wav)
+{
+    wav_format fmt;
+    size_t offset, datalen;
+    if (!wav || wav_parse (wav->data (), wav->size (), fmt, &offset, &datalen))
+    {
+        out.close (-1);
+        return -1;
+    }
+    out.open (fmt);
+    // samples are shared with wav
+    out.write (std::make_shared<audio> (wav->data () + offset, datalen, wav));
+    {
+        std::unique_lock<std::mutex> lock (out._mutex);
+        out._whole = wav;
+    }
+    out.close ();
+    return 0;
+}
+
+audio_stream_ptr
+audio_stream::of (const audio_ptr& wav)
+{
+    audio_stream_ptr s = std::make_shared<audio_stream> ();
+    feed (*s, wav);
+    return s;
+}
+
+int
+audio_stream::reader::format (wav_format& fmt)
+{
+    std::unique_lock<std::mutex> lock (_s._mutex);
+    _s._cv.wait (lock, [this]() { return _s._opened || _s._closed; });
+    if (!_s._opened || _s._err) return -1;
+
+    fmt = _s._fmt;
+    return 0;
+}
+
+int
+audio_stream::reader::next (audio_ptr& pcm)
+{
+    std::unique_lock<std::mutex> lock (_s._mutex);
+    _s._cv.wait (lock, [this]() { return _pos < _s._chunks.size () || _s._closed; });
+    if (_s._err) return -1;
+    if (_pos == _s._chunks.size ()) return 0;  // closed, and nothing left
+
+    pcm = _s._chunks[_pos++];
+    return 1;
+}
@@ -0,0 +1,67 @@
+//
+
+#ifndef TTS_AUDIO_STREAM_H
+#define TTS_AUDIO_STREAM_H
+
+#include "audio.h"
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// speech delivered chunk by chunk, from one synthesizer (producer) to the sinks (readers)
+// chunks are PCM samples (no header), appended and never modified.
+// every reader keeps its own cursor, so a slow sink never holds back the producer or the other sinks.
+class audio_stream
+{
+public:
+    audio_stream ();
+
+    // producer
+    void open (const wav_format& fmt);		// before the first chunk
+    int write (const uint8_t* pcm, size_t len);	// copies pcm
+    int write (const audio_ptr& pcm);		// no copy
+    void close (int err = 0);			// end of stream (err != 0: aborted)
+
+    // blocks until the stream is closed, and returns the err given to close
+    int wait ();
+    // the whole speech as a wav, once the stream is closed (blocking)
+    // (the very wav given to feed, if the stream was fed; a copy of the chunks otherwise)
+    audio_ptr wav ();
+
+    // wav -> out as a single chunk, sharing the samples of wav (no copy); out gets closed
+    static int feed (audio_stream& out, const audio_ptr& wav);
+    // closed stream of a single chunk (see feed)
+    static std::shared_ptr<audio_stream> of (const audio_ptr& wav);
+
+    // consumer
+    class reader
+    {
+    public:
+        reader (audio_stream& s) : _s (s), _pos (0) {}
+
+        int format (wav_format& fmt);	// blocking; -1 if the stream is aborted before open
+        int next (audio_ptr& pcm);	// blocking; 1: chunk, 0: end of stream, -1: aborted
+
+    private:
+        audio_stream& _s;
+        size_t _pos;		// index of the next chunk
+    };
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+
+    wav_format _fmt;
+    bool _opened;
+    bool _closed;
+    int _err;
+    std::vector<audio_ptr> _chunks;
+    size_t _len;		// total bytes of pcm
+    audio_ptr _whole;		// the wav the stream was fed with (see feed)
+};
+
+typedef std::shared_ptr<audio_stream> audio_stream_ptr;
+
+#endif
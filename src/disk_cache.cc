@@ -0,0 +1,429 @@
+//
+
+#include "disk_cache.h"
+#include "logger.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+// record in the index (followed by keylen bytes of key)
+struct record
+{
+    uint32_t magic;
+    uint32_t seg;
+    uint64_t offset;
+    uint32_t len;
+    uint32_t keylen;
+    uint32_t sum;	// checksum over the record (with sum = 0) and the key
+    uint32_t datasum;	// checksum over the wav data
+};
+
+static const uint32_t RECORD_MAGIC = 0x44535454;  // "TTSD" (was "TTSC" before datasum)
+
+// FNV-1a
+static uint32_t
+checksum (const void* data, size_t len, uint32_t h = 2166136261u)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    for (size_t i = 0; i < len; i++) { h ^= p[i]; h *= 16777619u; }
+    return h;
+}
+
+static uint32_t
+record_sum (record r, const std::string& key)
+{
+    r.sum = 0;
+    return checksum (key.data (), key.length (), checksum (&r, sizeof (r)));
+}
+
+// write all, or fail
+static int
+write_all (int fd, const void* data, size_t len, off_t offset = -1)
+{
+    const uint8_t* p = (const uint8_t*)data;
+    while (len > 0)
+    {
+        ssize_t n = (offset < 0) ? write (fd, p, len) : pwrite (fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+        if (offset >= 0) offset += n;
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------------------------
+// segments
+// --------------------------------------------------------------------------------
+
+struct disk_cache::segment
+{
+    uint32_t id;
+    std::string path;
+    int fd;
+    uint8_t* map;	// read-only mapping of the whole file
+    size_t size;	// file size
+    size_t used;	// bytes appended
+    size_t live;	// bytes of the entries (and reservations) in the segment
+
+    segment () : id (0), fd (-1), map (nullptr), size (0), used (0), live (0) {}
+    ~segment ()
+    {
+        if (map) munmap (map, size);
+        if (fd >= 0) close (fd);
+    }
+};
+
+disk_cache::segment_ptr
+disk_cache::segment_open (uint32_t id, bool create)
+{
+    segment_ptr s = std::make_shared<segment> ();
+    s->id = id;
+    s->path = _dir + "/seg." + std::to_string (id);
+
+    s->fd = open (s->path.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+    if (s->fd < 0)
+    {
+        syslog (LOG_ERR, "[disk_cache] open (\"%s\") failed: %s", s->path.c_str(), strerror (errno));
+        return nullptr;
+    }
+    // sparse file of the full segment size; disk space is taken only by what is written
+    if (create && ftruncate (s->fd, _segment_size))
+    {
+        syslog (LOG_ERR, "[disk_cache] ftruncate (\"%s\") failed: %s", s->path.c_str(), strerror (errno));
+        unlink (s->path.c_str());
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat (s->fd, &st) || st.st_size == 0) return nullptr;
+    s->size = st.st_size;
+
+    // pwrite's to fd are visible through the (shared) mapping
+    void* map = mmap (nullptr, s->size, PROT_READ, MAP_SHARED, s->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        syslog (LOG_ERR, "[disk_cache] mmap (\"%s\") failed: %s", s->path.c_str(), strerror (errno));
+        return nullptr;
+    }
+    s->map = (uint8_t*)map;
+
+    return s;
+}
+
+// --------------------------------------------------------------------------------
+// cache
+// --------------------------------------------------------------------------------
+
+disk_cache::disk_cache ()
+    : _capacity (512 * 1024 * 1024), _segment_size (64 * 1024 * 1024),
+      _index_fd (-1), _next_id (0), _size (0), _hits (0), _misses (0), _evictions (0)
+{
+}
+
+disk_cache::~disk_cache ()
+{
+    if (_index_fd >= 0) close (_index_fd);
+}
+
+// conf = {"directory": "/var/cache/tts_server", "disk_mb": 512, "segment_mb": 64}
+int
+disk_cache::configure (const nlohmann::json& conf)
+{
+    syslog (LOG_NOTICE, "[disk_cache] %s", conf.dump().c_str());
+    if (!conf.is_object ()) return -1;
+    if (conf.find ("directory") == conf.end ()) return 0;  // disabled
+
+    std::unique_lock<std::mutex> lock (_mutex);
+
+    if (!conf["directory"].is_string ()) return -1;
+    _dir = conf["directory"];
+    if (conf.find ("disk_mb") != conf.end ())
+    {
+        if (!conf["disk_mb"].is_number ()) return -1;
+        _capacity = (size_t)(conf["disk_mb"].get<double>() * 1024 * 1024);
+    }
+    if (conf.find ("segment_mb") != conf.end ())
+    {
+        if (!conf["segment_mb"].is_number ()) return -1;
+        _segment_size = (size_t)(conf["segment_mb"].get<double>() * 1024 * 1024);
+    }
+    if (_segment_size == 0 || _segment_size > _capacity)
+    {
+        syslog (LOG_ERR, "[disk_cache] invalid sizes: disk=%zu segment=%zu", _capacity, _segment_size);
+        return -1;
+    }
+
+    return load ();
+}
+
+// index & segments -> _entries (called with _mutex held)
+int
+disk_cache::load ()
+{
+    if (mkdir (_dir.c_str(), 0755) && errno != EEXIST)
+    {
+        syslog (LOG_ERR, "[disk_cache] mkdir (\"%s\") failed: %s", _dir.c_str(), strerror (errno));
+        return -1;
+    }
+
+    const std::string path = _dir + "/index";
+    int fd = open (path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+    {
+        syslog (LOG_ERR, "[disk_cache] open (\"%s\") failed: %s", path.c_str(), strerror (errno));
+        return -1;
+    }
+
+    // index -> bytes
+    std::vector<uint8_t> bytes;
+    uint8_t buff[65536];
+    ssize_t n;
+    while ((n = read (fd, buff, sizeof (buff))) > 0) bytes.insert (bytes.end (), buff, buff + n);
+
+    // records
+    size_t pos = 0;
+    size_t skipped = 0;
+    while (pos + sizeof (record) <= bytes.size ())
+    {
+        record r;
+        memcpy (&r, bytes.data () + pos, sizeof (r));
+        if (r.magic != RECORD_MAGIC || pos + sizeof (r) + r.keylen > bytes.size ()) break;
+        const std::string key ((const char*)bytes.data () + pos + sizeof (r), r.keylen);
+        if (record_sum (r, key) != r.sum) break;
+        pos += sizeof (r) + r.keylen;
+        // even the ids of the segments that are gone are not to be reused
+        if (r.seg >= _next_id) _next_id = r.seg + 1;
+
+        skipped++;
+        if (_segments.find (r.seg) == _segments.end ())
+        {
+            segment_ptr s = segment_open (r.seg, false);
+            if (!s) continue;
+            _segments[r.seg] = s;
+        }
+        segment_ptr& s = _segments[r.seg];
+        if (r.offset + r.len > s->size) continue;
+        if (checksum (s->map + r.offset, r.len) != r.datasum) continue;
+        skipped--;
+
+        _entries[key] = entry { r.seg, r.offset, r.len, r.datasum };
+        if (r.offset + r.len > s->used) s->used = r.offset + r.len;
+    }
+    // the tail of an interrupted append
+    if (pos < bytes.size ())
+    {
+        syslog (LOG_WARNING, "[disk_cache] index truncated: %zuB -> %zuB", bytes.size (), pos);
+        if (ftruncate (fd, pos)) { close (fd); return -1; }
+    }
+    _index_fd = fd;
+
+    for (const std::pair<const std::string, entry>& kv : _entries)
+    {
+        _segments[kv.second.seg]->live += kv.second.len;
+        _size += kv.second.len;
+    }
+
+    // segments that no record refers to
+    DIR* dir = opendir (_dir.c_str());
+    if (dir)
+    {
+        struct dirent* ent;
+        while ((ent = readdir (dir)))
+        {
+            if (strncmp (ent->d_name, "seg.", 4)) continue;
+            const uint32_t id = strtoul (ent->d_name + 4, nullptr, 10);
+            if (id >= _next_id) _next_id = id + 1;
+            if (_segments.find (id) != _segments.end ()) continue;
+            unlink ((_dir + "/" + ent->d_name).c_str());
+        }
+        closedir (dir);
+    }
+
+    // the records of missing or altered data are dropped from the index
+    if (skipped)
+    {
+        syslog (LOG_WARNING, "[disk_cache] %zu record(s) discarded", skipped);
+        index_rewrite ();
+    }
+
+    syslog (LOG_NOTICE, "[disk_cache] %zu entries (%zuB) in %zu segments loaded from %s",
+            _entries.size (), _size, _segments.size (), _dir.c_str());
+
+    evict ();
+    return 0;
+}
+
+audio_ptr
+disk_cache::find (const std::string& key)
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    if (_index_fd < 0) return nullptr;
+
+    std::unordered_map<std::string, entry>::const_iterator it = _entries.find (key);
+    if (it == _entries.end ())
+    {
+        _misses++;
+        return nullptr;
+    }
+    _hits++;
+
+    // the segment stays mapped as long as the wav is referred to (even after eviction)
+    const segment_ptr& s = _segments[it->second.seg];
+    return std::make_shared<audio> (s->map + it->second.offset, it->second.len, s);
+}
+
+int
+disk_cache::insert (const std::string& key, const audio_ptr& wav)
+{
+    if (!wav || wav->size () == 0) return -1;
+
+    // reserve space in the newest segment (or a new one)
+    segment_ptr s;
+    entry e;
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        if (_index_fd < 0 || wav->size () > _segment_size) return -1;
+        if (_entries.find (key) != _entries.end ()) return 0;
+
+        if (!_segments.empty ()) s = _segments.rbegin()->second;
+        if (!s || s->used + wav->size () > s->size)
+        {
+            const uint32_t id = _next_id++;
+            s = segment_open (id, true);
+            if (!s) return -1;
+            _segments[id] = s;
+        }
+        e = entry { s->id, s->used, (uint32_t)wav->size (), 0 };
+        s->used += wav->size ();
+        s->live += wav->size ();
+        _size += wav->size ();
+    }
+
+    // data first (outside the lock), then the record
+    e.sum = checksum (wav->data (), wav->size ());
+    const int err = write_all (s->fd, wav->data (), wav->size (), e.offset) || fdatasync (s->fd);
+    if (err) syslog (LOG_ERR, "[disk_cache] write to \"%s\" failed: %s", s->path.c_str(), strerror (errno));
+
+    std::unique_lock<std::mutex> lock (_mutex);
+    // inserted meanwhile (by another worker), or failed
+    if (err || _entries.find (key) != _entries.end () || index_append (key, e))
+    {
+        release (e);
+        return err ? -1 : 0;
+    }
+    _entries[key] = e;
+    evict ();
+
+    return 0;
+}
+
+// (called with _mutex held)
+int
+disk_cache::index_append (const std::string& key, const entry& e)
+{
+    if (_segments.find (e.seg) == _segments.end ()) return -1;  // evicted meanwhile
+
+    record r = { RECORD_MAGIC, e.seg, e.offset, e.len, (uint32_t)key.length (), 0, e.sum };
+    r.sum = record_sum (r, key);
+
+    std::string bytes ((const char*)&r, sizeof (r));
+    bytes.append (key);
+    if (write_all (_index_fd, bytes.data (), bytes.length ()) || fdatasync (_index_fd))
+    {
+        syslog (LOG_ERR, "[disk_cache] index append failed: %s", strerror (errno));
+        return -1;
+    }
+    return 0;
+}
+
+// index <- _entries, replaced atomically (called with _mutex held)
+int
+disk_cache::index_rewrite ()
+{
+    const std::string path = _dir + "/index";
+    const std::string tmp = path + ".tmp";
+    int fd = open (tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (fd < 0) return -1;
+
+    std::string bytes;
+    for (const std::pair<const std::string, entry>& kv : _entries)
+    {
+        record r = { RECORD_MAGIC, kv.second.seg, kv.second.offset, kv.second.len, (uint32_t)kv.first.length (), 0, kv.second.sum };
+        r.sum = record_sum (r, kv.first);
+        bytes.append ((const char*)&r, sizeof (r));
+        bytes.append (kv.first);
+    }
+    if (write_all (fd, bytes.data (), bytes.length ()) || fsync (fd) || rename (tmp.c_str(), path.c_str()))
+    {
+        syslog (LOG_ERR, "[disk_cache] index rewrite failed: %s", strerror (errno));
+        close (fd);
+        unlink (tmp.c_str());
+        return -1;
+    }
+
+    close (_index_fd);
+    _index_fd = fd;
+    return 0;
+}
+
+// gives back the space reserved for e, which is not to be recorded (called with _mutex held)
+void
+disk_cache::release (const entry& e)
+{
+    std::map<uint32_t, segment_ptr>::iterator it = _segments.find (e.seg);
+    if (it == _segments.end ()) return;  // evicted: released with its segment
+    const segment_ptr& s = it->second;
+    s->live -= e.len;
+    _size -= e.len;
+    if (s->used == e.offset + e.len) s->used = e.offset;  // the last one: reusable
+}
+
+// drops the oldest segments, but the newest one, while over capacity (called with _mutex held)
+void
+disk_cache::evict ()
+{
+    bool evicted = false;
+    while (_size > _capacity && _segments.size () > 1)
+    {
+        const segment_ptr s = _segments.begin()->second;
+        for (std::unordered_map<std::string, entry>::iterator it = _entries.begin (); it != _entries.end (); )
+        {
+            if (it->second.seg == s->id) it = _entries.erase (it); else ++it;
+        }
+        _size -= s->live;
+        unlink (s->path.c_str());
+        _segments.erase (_segments.begin ());
+        _evictions++;
+        evicted = true;
+        syslog (LOG_INFO, "[disk_cache] segment %u evicted", s->id);
+    }
+    if (evicted) index_rewrite ();
+}
+
+nlohmann::json
+disk_cache::stats () const
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+
+    nlohmann::json s;
+    s["directory"] = _dir;
+    s["capacity"] = _capacity;
+    s["size"] = _size;
+    s["entries"] = _entries.size ();
+    s["segments"] = _segments.size ();
+    s["hits"] = _hits;
+    s["misses"] = _misses;
+    s["evictions"] = _evictions;
+    return s;
+}
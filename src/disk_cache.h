@@ -0,0 +1,78 @@
+//
+
+#ifndef TTS_DISK_CACHE_H
+#define TTS_DISK_CACHE_H
+
+#include "audio.h"
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <nlohmann/json.hpp>
+
+// persistent cache of synthesized speech (wav), which survives restarts
+//
+// <directory>/index		append-only log of records (header + key), one per entry
+// <directory>/seg.<n>		packed wav data, memory-mapped for reading
+//
+// crash safety: the wav data is synced before its record is appended, and
+// records that are truncated or fail their checksum (which covers the wav data) are discarded at startup.
+// segment ids are never reused, so that a record left behind cannot refer to other data.
+// eviction: when the total size exceeds the limit, the oldest segment is dropped as a whole.
+class disk_cache
+{
+public:
+    disk_cache ();
+    ~disk_cache ();
+
+    // conf = {directory, disk_mb, segment_mb}
+    int configure (const nlohmann::json& conf);
+    bool enabled () const { return _index_fd >= 0; }
+
+    // the returned wav refers to the mapped segment (no copy)
+    audio_ptr find (const std::string& key);
+    int insert (const std::string& key, const audio_ptr& wav);
+
+    nlohmann::json stats () const;
+
+private:
+    struct segment;
+    typedef std::shared_ptr<segment> segment_ptr;
+
+    struct entry
+    {
+        uint32_t seg;
+        uint64_t offset;
+        uint32_t len;
+        uint32_t sum;	// of the wav data
+    };
+
+    int load ();
+    segment_ptr segment_open (uint32_t id, bool create);
+    int index_append (const std::string& key, const entry& e);
+    int index_rewrite ();
+    void release (const entry& e);
+    void evict ();
+
+private:
+    std::string _dir;
+    size_t _capacity;		// bytes
+    size_t _segment_size;	// bytes
+
+    int _index_fd;
+    std::map<uint32_t, segment_ptr> _segments;		// id -> segment (oldest first)
+    std::unordered_map<std::string, entry> _entries;	// key -> entry
+    uint32_t _next_id;		// of the next segment
+    size_t _size;		// bytes in use (entries and reservations)
+    mutable std::mutex _mutex;
+
+    // counters
+    uint64_t _hits;
+    uint64_t _misses;
+    uint64_t _evictions;	// segments
+};
+
+#endif
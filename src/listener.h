@@ -13,6 +13,9 @@ public:
     virtual int run (void) = 0;
     virtual void quit (void) = 0;
 
+    // status events (rejected requests, stats, etc) sent back to clients
+    virtual int publish (const nlohmann::json& /*status*/) { return 0; }
+
 public:
     std::string name;
 };
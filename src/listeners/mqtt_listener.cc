@@ -30,6 +30,7 @@
 #include "mqtt_listener.h"
 #include "server.h"
 #include "logger.h"
+#include "task_queue.h"
 
 using json = nlohmann::json;
 
@@ -86,6 +87,10 @@ mqtt_listener::setup (const nlohmann::json& conf)
 
     assert (!topic.empty());
     _topics.push_back (topic);
+
+    // status topic (optional)
+    if (conf.find ("status_topic") != conf.end () && conf["status_topic"].is_string ())
+        _status_topic = conf["status_topic"];
     //if (mqtt_topic_re) g_mqtt_topic_re = new std::regex (mqtt_topic_re);
 
     int rslt = MOSQ_ERR_SUCCESS;
@@ -156,6 +161,23 @@ mqtt_listener::quit (void)
     _mosq = nullptr;
 }
 
+int
+mqtt_listener::publish (const nlohmann::json& status)
+{
+    if (!_mosq || _status_topic.empty ()) return 0;
+
+    const std::string payload = status.dump ();
+    int rslt = mosquitto_publish (_mosq, NULL, _status_topic.c_str(), payload.length (), payload.c_str(), 0, false);
+      // mosq, mid, topic, payload_len, payload, qos, retain
+    if (rslt != MOSQ_ERR_SUCCESS)
+    {
+        syslog (LOG_ERR, "[mqtt_listener::publish] failed (%d): %s", rslt, mosquitto_strerror (rslt));
+        return -1;
+    }
+
+    return 0;
+}
+
 // --------------------------------------------------------------------------------
 // mqtt callbacks
 // --------------------------------------------------------------------------------
@@ -210,7 +232,23 @@ cb_message (struct mosquitto* mosq, void* user, const struct mosquitto_message*
         return;
     }
 
-    tts_server::req_enqueue (new json(req));
+    // json -> request (validated here, once)
+    request* r = new request ();
+    if (r->parse (req))
+    {
+        syslog (LOG_ERR, "[cb_message] invalid request: %s", payload);
+        delete r;
+        return;
+    }
+
+    int rslt = tts_server::req_enqueue (r);
+    if (rslt == task_queue::REJECTED)
+    {
+        // let the clients know (the queue is full)
+        json status;
+        status["rejected"] = req;
+        ((mqtt_listener*)user)->publish (status);
+    }
 
     /*
     mosquitto_message* copy = (mosquitto_message*) malloc (sizeof (mosquitto_message));
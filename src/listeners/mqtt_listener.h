@@ -17,6 +17,7 @@ public:
     int setup (const nlohmann::json&) override;
     int run (void) override;
     void quit (void) override;
+    int publish (const nlohmann::json& status) override;
 
     std::list<std::string>& topics() { return _topics; }
 
@@ -25,6 +26,7 @@ private:
     std::string _address;
     int _port;
     std::list<std::string> _topics;
+    std::string _status_topic;	// status events are published to this topic (if any)
 
     static bool _initialized;
 };
@@ -0,0 +1,257 @@
+//
+
+#include "request.h"
+#include "logger.h"
+#include "task_queue.h"
+
+#include <algorithm>
+#include <cctype>
+
+request::request ()
+    : ssml (false), language ("en"), gender (UNSPECIFIED), rate (-1), pitch (-1), volume (-1),
+      priority (task_queue::NORMAL), split (false),
+      sinks_specified (false)
+{
+}
+
+static request::gender_t
+gender_of (const std::string& str)
+{
+    if (str.empty ()) return request::UNSPECIFIED;
+    switch (toupper (str[0]))
+    {
+    case 'M': return request::MALE;
+    case 'F': return request::FEMALE;
+    case 'N': return request::NEUTRAL;
+    }
+    return request::UNSPECIFIED;
+}
+
+static bool
+get_string (const nlohmann::json& obj, const char* key, std::string& val)
+{
+    nlohmann::json::const_iterator it = obj.find (key);
+    if (it == obj.end () || !it->is_string ()) return false;
+    val = it->get<std::string>();
+    return true;
+}
+
+static bool
+get_int (const nlohmann::json& obj, const char* key, int& val)
+{
+    nlohmann::json::const_iterator it = obj.find (key);
+    if (it == obj.end () || !it->is_number ()) return false;
+    val = it->get<int>();
+    return true;
+}
+
+int
+request::parse (const nlohmann::json& req)
+{
+    if (!req.is_object ())
+    {
+        syslog (LOG_ERR, "[request::parse] not an object");
+        return -1;
+    }
+
+    // idempotency key
+    if (!get_string (req, "id", id))
+        get_string (req, "idempotency_key", id);
+
+    // input: text, ssml
+    nlohmann::json::const_iterator input = req.find ("input");
+    if (input != req.end () && input->is_object ())
+    {
+        if (get_string (*input, "text", text))
+            ssml = false;
+        else if (get_string (*input, "ssml", text))
+            ssml = true;
+    }
+    if (text.empty ())
+    {
+        if (get_string (req, "text", text))
+            ssml = false;
+        else if (get_string (req, "ssml", text))
+            ssml = true;
+    }
+    if (text.empty ())
+    {
+        syslog (LOG_ERR, "[request::parse] no text found");
+        return -1;
+    }
+
+    // voice: language, gender, name
+    get_string (req, "language", language);
+    std::string str;
+    if (get_string (req, "gender", str)) gender = gender_of (str);
+    nlohmann::json::const_iterator v = req.find ("voice");
+    if (v != req.end ())
+    {
+        if (v->is_string ())
+            voice = v->get<std::string>();
+        else if (v->is_object ())
+        {
+            get_string (*v, "languageCode", language);
+            get_string (*v, "name", voice);
+            if (get_string (*v, "ssmlGender", str)) gender = gender_of (str);
+        }
+    }
+    if (language.length () < 2)
+    {
+        syslog (LOG_ERR, "[request::parse] invalid language: \"%s\"", language.c_str());
+        return -1;
+    }
+
+    // prosody: rate, pitch, volume
+    get_int (req, "rate", rate);
+    get_int (req, "pitch", pitch);
+    get_int (req, "volume", volume);
+    if (rate == 0 || rate < -1 || pitch < -1 || pitch > 100 || volume < -1)
+    {
+        syslog (LOG_ERR, "[request::parse] invalid rate/pitch/volume: %d/%d/%d", rate, pitch, volume);
+        return -1;
+    }
+
+    // synthesizer selection
+    get_string (req, "engine", engine);
+    if (!get_string (req, "synthesizer", synthesizer))
+        get_string (req, "name", synthesizer);
+    get_string (req, "host", host);
+
+    // priority
+    if (req.find ("priority") != req.end ())
+        priority = task_queue::priority_of (req["priority"]);
+
+    // split into sentences
+    nlohmann::json::const_iterator sp = req.find ("split");
+    if (sp != req.end () && sp->is_boolean ()) split = sp->get<bool>();
+
+    // sinks
+    nlohmann::json::const_iterator seq = req.find ("sinks");
+    if (seq != req.end ())
+    {
+        if (!seq->is_array ())
+        {
+            syslog (LOG_ERR, "[request::parse] invalid sinks");
+            return -1;
+        }
+        for (const nlohmann::json& s : *seq)
+        {
+            if (!s.is_string ()) continue;
+            sink_names.push_back (s.get<std::string>());
+        }
+        sinks_specified = true;
+    }
+
+    return 0;
+}
+
+// what synthesizers look at (parse (dump ()) reproduces them)
+nlohmann::json
+request::dump () const
+{
+    static const char* genders[] = { "", "MALE", "FEMALE", "NEUTRAL" };
+
+    nlohmann::json j;
+    j[ssml ? "ssml" : "text"] = text;
+    j["language"] = language;
+    if (gender != UNSPECIFIED) j["gender"] = genders[gender];
+    if (!voice.empty ()) j["voice"] = voice;
+    if (rate >= 0) j["rate"] = rate;
+    if (pitch >= 0) j["pitch"] = pitch;
+    if (volume >= 0) j["volume"] = volume;
+    if (!engine.empty ()) j["engine"] = engine;
+    if (!synthesizer.empty ()) j["synthesizer"] = synthesizer;
+    if (!host.empty ()) j["host"] = host;
+    return j;
+}
+
+// text with whitespace trimmed and collapsed, followed by the voice parameters
+std::string
+request::key () const
+{
+    std::string k;
+    k.reserve (text.length () + language.length () + voice.length () + 8);
+
+    k.push_back (ssml ? 'S' : 'T');
+    bool space = true;  // trims leading spaces
+    for (char c : text)
+    {
+        if (isspace ((unsigned char)c)) { space = true; continue; }
+        if (space && k.length () > 1) k.push_back (' ');
+        space = false;
+        k.push_back (c);
+    }
+    k.push_back ('\0');
+    k.append (language).push_back ('\0');
+    k.push_back ('0' + gender);
+    k.push_back ('\0');
+    k.append (voice).push_back ('\0');
+    k.append (std::to_string (rate)).push_back (',');
+    k.append (std::to_string (pitch)).push_back (',');
+    k.append (std::to_string (volume));
+
+    return k;
+}
+
+std::string
+request::voice_key () const
+{
+    std::string k (lang2 ());
+    k.push_back ('0' + gender);
+    k.append (voice);
+    return k;
+}
+
+// length of the sentence terminator at text[i] (0 if none)
+// ascii ". ! ?" need to be followed by a space (not to split "3.14" or "e.g.x")
+static size_t
+terminator (const std::string& text, size_t i)
+{
+    const unsigned char c = text[i];
+    if (c == '\n') return 1;
+    if (c == '.' || c == '!' || c == '?')
+        return (i + 1 == text.length () || isspace ((unsigned char)text[i + 1])) ? 1 : 0;
+    // "。" (e3 80 82), "！" (ef bc 81), "？" (ef bc 9f)
+    if (i + 3 <= text.length ())
+    {
+        const unsigned char c1 = text[i + 1], c2 = text[i + 2];
+        if (c == 0xe3 && c1 == 0x80 && c2 == 0x82) return 3;
+        if (c == 0xef && c1 == 0xbc && (c2 == 0x81 || c2 == 0x9f)) return 3;
+    }
+    return 0;
+}
+
+std::vector<request>
+request::sentences () const
+{
+    std::vector<request> segs;
+    if (ssml)
+    {
+        segs.push_back (*this);
+        return segs;
+    }
+
+    size_t start = 0;
+    for (size_t i = 0; i <= text.length (); )
+    {
+        const size_t n = (i < text.length ()) ? terminator (text, i) : 1;
+        if (n == 0) { i++; continue; }
+
+        // text[start .. i+n) without surrounding spaces
+        size_t b = start, e = std::min (i + n, text.length ());
+        while (b < e && isspace ((unsigned char)text[b])) b++;
+        while (e > b && isspace ((unsigned char)text[e - 1])) e--;
+        if (b < e)
+        {
+            segs.push_back (*this);
+            segs.back().text = text.substr (b, e - b);
+            segs.back().split = false;
+        }
+        i += n;
+        start = i;
+    }
+    if (segs.empty ()) segs.push_back (*this);
+
+    return segs;
+}
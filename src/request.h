@@ -0,0 +1,61 @@
+//
+
+#ifndef TTS_REQUEST_H
+#define TTS_REQUEST_H
+
+#include <list>
+#include <string>
+#include <vector>
+#include <nlohmann/json.hpp>
+
+class sink;
+
+// typed request, compiled once from the json payload at ingress
+// payload = {id, text | ssml | input:{text|ssml}, language, gender, voice, rate, pitch, volume,
+//            engine, synthesizer, host, priority, split, sinks:[..]}
+struct request
+{
+    enum gender_t { UNSPECIFIED, MALE, FEMALE, NEUTRAL };
+
+    std::string id;		// idempotency key (optional): deliveries with the same id are dropped within a window
+    std::string text;		// plain text or ssml
+    bool ssml;
+    std::string language;	// language tag, e.g. "en", "en-US" (fallback: "en")
+    gender_t gender;		// UNSPECIFIED = engine default
+    std::string voice;		// voice name (engine specific)
+    int rate;			// words per minute (-1 = engine default)
+    int pitch;			// 0..100 (-1 = engine default)
+    int volume;			// 0..200, 100 = normal (-1 = engine default)
+    std::string engine;		// empty = any
+    std::string synthesizer;	// synthesizer name (empty = any)
+    std::string host;		// synthesizer host (empty = any)
+    int priority;		// task_queue::priority
+    bool split;			// synthesize sentence by sentence (in parallel, where possible)
+
+    bool sinks_specified;
+    std::list<std::string> sink_names;
+    std::list<sink*> sinks;	// resolved by tts_server::req_enqueue
+
+public:
+    request ();
+
+    // json -> request (returns -1 when invalid)
+    int parse (const nlohmann::json& req);
+
+    // request -> json (the synthesis parameters only; e.g. for worker processes)
+    nlohmann::json dump () const;
+
+    // language prefix (e.g. "en")
+    std::string lang2 () const { return language.substr (0, 2); }
+
+    // what determines the speech: normalized text, language, gender, voice, prosody (for caches)
+    std::string key () const;
+
+    // what selects the voice of an engine: language, gender, voice (for voice-affine scheduling)
+    std::string voice_key () const;
+
+    // one request per sentence (the text is not split for ssml)
+    std::vector<request> sentences () const;
+};
+
+#endif
@@ -0,0 +1,86 @@
+//
+
+#include "route_table.h"
+#include "logger.h"
+
+#include <cassert>
+
+std::string
+route_table::key (const std::string& name, const std::string& engine, const std::string& lang, const std::string& host)
+{
+    std::string key;
+    key.reserve (name.length () + engine.length () + host.length () + 5);
+    key.append (name).push_back ('\0');
+    key.append (engine.compare ("any") ? engine : "").push_back ('\0');
+    key.append (lang, 0, 2).push_back ('\0');
+    key.append (host);
+    return key;
+}
+
+void
+route_table::build (const std::list<synthesizer*>& synths)
+{
+    _synths = synths;
+    _routes.clear ();
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _memo.clear ();
+    }
+
+    request r;
+    for (synthesizer* s : _synths)
+        for (const std::string& lang : s->languages)
+            for (const std::string& name : { std::string (), s->name })
+                for (const std::string& eng : { std::string (), s->engine })
+                {
+                    r.synthesizer = name;
+                    r.engine = eng;
+                    r.language = lang;
+                    // the same choice as scan
+                    synthesizer* found = scan (r);
+                    if (found) _routes.emplace (key (name, eng, lang, ""), found);
+                }
+    syslog (LOG_INFO, "[route_table] %d routes", (int)_routes.size ());
+}
+
+synthesizer*
+route_table::scan (const request& req) const
+{
+    const std::string& name = req.synthesizer;
+    for (synthesizer* s : _synths)
+    {
+        assert (s);
+        if (!name.empty() && name.compare(s->name)) continue;
+        if (!s->synthesizable (req)) continue;
+        return (s);
+    }
+    return nullptr;
+}
+
+synthesizer*
+route_table::find (const request& req)
+{
+    const std::string k = key (req.synthesizer, req.engine, req.language, req.host);
+
+    // built -- no lock
+    std::unordered_map<std::string, synthesizer*>::const_iterator it = _routes.find (k);
+    if (it != _routes.end ()) return it->second;
+
+    // memoized
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        it = _memo.find (k);
+        if (it != _memo.end ()) return it->second;
+    }
+
+    // miss -- fall back to the scan, and memoize its result (including "not found")
+    synthesizer* s = scan (req);
+    syslog (LOG_DEBUG, "[route_table] name=\"%s\" engine=\"%s\" language=%s host=%s: %s",
+            req.synthesizer.c_str(), req.engine.c_str(), req.language.c_str(), req.host.c_str(),
+            s ? s->name.c_str() : "(none)");
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        if (_memo.size () < _memo_max) _memo.emplace (k, s);
+    }
+    return s;
+}
@@ -0,0 +1,42 @@
+//
+
+#ifndef TTS_ROUTE_TABLE_H
+#define TTS_ROUTE_TABLE_H
+
+#include "request.h"
+#include "synthesizer.h"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+// routing table: (name, engine, language prefix, host) -> synthesizer
+// the plain keys are filled at setup (build), and are read without locking from then on;
+// the others are memoized upon lookup (bounded), under a lock of their own.
+// synthesizers are fixed after setup, hence entries never get stale.
+class route_table
+{
+public:
+    route_table (size_t memo_max = 1024) : _memo_max (memo_max) {}
+
+    // synthesizers in the order of preference (the first one that matches is chosen)
+    void build (const std::list<synthesizer*>& synths);
+
+    // nullptr if none
+    synthesizer* find (const request& req);
+    // linear scan over the synthesizers (the reference for find)
+    synthesizer* scan (const request& req) const;
+
+    static std::string key (const std::string& name, const std::string& engine, const std::string& lang, const std::string& host);
+
+private:
+    std::list<synthesizer*> _synths;
+    std::unordered_map<std::string, synthesizer*> _routes;	// read-only after build
+
+    std::unordered_map<std::string, synthesizer*> _memo;	// results of scan, including "not found"
+    size_t _memo_max;
+    std::mutex _mutex;	// of _memo
+};
+
+#endif
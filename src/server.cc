@@ -2,16 +2,23 @@
 
 #include "server.h"
 #include "logger.h"
+#include "task_queue.h"
+#include "audio_cache.h"
+#include "disk_cache.h"
+#include "route_table.h"
 #include "listeners/mqtt_listener.h"
 #include "synthesizers/synth_espeak.h"
 #include "synthesizers/synth_festival.h"
 #include "synthesizers/synth_gcloud.h"
+#include "synthesizers/synth_pool.h"
 #include "sinks/sink_pulseaudio.h"
 #include "sinks/sink_sftp.h"
 
 #include <nlohmann/json.hpp>
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cctype>
 #include <cinttypes>
@@ -20,17 +27,21 @@
 #include <cstdio>
 #include <cstring>
 #include <fstream>
+#include <deque>
 #include <list>
 #include <queue>
 #include <regex>
+#include <unordered_map>
 #include <utility>
 
 #include <functional>
 #include <future>
+#include <mutex>
 #include <thread>
 #include <condition_variable>
 
 #include <libgen.h>
+#include <signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -97,8 +108,9 @@ synth_add (const nlohmann::json& spec)
     assert (spec["languages"].is_array ());
     const std::vector<std::string> langs = spec["languages"];
 
-    // host
-    const std::string host = (spec.find ("host") != spec.end ()) ? spec["host"] : "";
+    // host(s): "host" or "hosts":[..] (see synth_gcloud)
+    const bool hosted = (spec.find ("host") != spec.end () && spec["host"].is_string () && !spec["host"].get<std::string>().empty ())
+        || (spec.find ("hosts") != spec.end () && spec["hosts"].is_array () && !spec["hosts"].empty ());
     // api
     const std::string api = (spec.find ("api") != spec.end ()) ? spec["api"] : "";
 
@@ -110,13 +122,31 @@ synth_add (const nlohmann::json& spec)
         if (!engine.compare ("espeak"))
             synth = new synth_espeak (spec);
         else if (!engine.compare ("festival"))
+        {
+            // festival is process-global: a second instance would share (and race on) it
+            static bool festival = false;
+            if (festival)
+            {
+                syslog (LOG_ERR, "[synth_add] festival already configured (one instance per process): %s", spec.dump().c_str());
+                return nullptr;
+            }
+            festival = true;
             synth = new synth_festival (spec);
+        }
     }
     else
     {
         // google cloud tts
-        if (!api.compare ("google::cloud::texttospeech::v1") && !host.empty())
+        if (!api.compare ("google::cloud::texttospeech::v1"))
+        {
+            if (!hosted)
+            {
+                // a misconfiguration, not to be skipped silently
+                syslog (LOG_ERR, "[synth_add] neither host nor hosts specified: %s", spec.dump().c_str());
+                raise (SIGKILL);
+            }
             synth = new synth_gcloud (spec);
+        }
     }
     if (!synth)
     {
@@ -124,33 +154,23 @@ synth_add (const nlohmann::json& spec)
         return nullptr;
     }
 
-    assert (synth);
-    _synthesizers.push_back (synth);
+    // worker processes (see synth_pool)
+    if (synth_pool::pooled (spec))
+        synth = new synth_pool (synth, spec);
 
+    assert (synth);
     return (synth);
 }
 
+// routing (see route_table)
+route_table g_routes;
+
 static synthesizer*
-synth_find (const nlohmann::json& req)
+synth_find (const request& req)
 {
-    //if (!req) return nullptr;
-    syslog (LOG_DEBUG, "[synth_find] %s", req.dump().c_str());
-
-    std::string name;
-    if (req.find("synthesizer") != req.end()) name = req["synthesizer"];
-
-    for (synthesizer* s : _synthesizers)
-    {
-        assert (s);
-        //std::cerr << "lang=" << syn.language << " address=" << syn.address << "\n";
-        if (!name.empty() && name.compare(s->name)) continue;
-        if (!s->synthesizable (req)) continue;
-        syslog (LOG_DEBUG, "[synth_find] found: engine=\"%s\"", s->engine.c_str());
-        return (s);
-    }
-
-    syslog (LOG_ERR, "[synth_find] no synthesizer found");
-    return nullptr;
+    synthesizer* s = g_routes.find (req);
+    if (!s) syslog (LOG_ERR, "[synth_find] no synthesizer found");
+    return s;
 }
 
 // --------------------------------------------------------------------------------
@@ -158,6 +178,7 @@ synth_find (const nlohmann::json& req)
 // --------------------------------------------------------------------------------
 
 std::list<sink*> _sinks;
+std::unordered_map<std::string, sink*> g_sinks_by_name;
 
 //
 //static sink* sink_add (const char* addr, const char* dev);
@@ -184,7 +205,18 @@ sink_add (const nlohmann::json& spec)
     }
 
     assert (s);
+
+    // bound on the deliveries waiting at the sink
+    if (spec.find ("max_depth") != spec.end ())
+    {
+        if (spec["max_depth"].is_number_unsigned ())
+            s->max_depth = spec["max_depth"];
+        else
+            syslog (LOG_ERR, "[sink_add] invalid max_depth: %s", spec["max_depth"].dump().c_str());
+    }
+
     _sinks.push_back (s);
+    g_sinks_by_name.emplace (s->name, s);  // the first one wins for duplicate names
 
     return (s);
 }
@@ -193,34 +225,24 @@ sink_add (const nlohmann::json& spec)
 static sink*
 sink_find (const std::string& name)
 {
-    syslog (LOG_DEBUG, "[sink_find] name=%s", name.c_str());
-
-    for (sink*& s : _sinks)
+    std::unordered_map<std::string, sink*>::const_iterator it = g_sinks_by_name.find (name);
+    if (it == g_sinks_by_name.end ())
     {
-        if (!name.compare (s->name)) return s;
+        syslog (LOG_WARNING, "[sink_find] unknown sink: %s", name.c_str());
+        return nullptr;
     }
-
-    //std::list<const sink*> matched;
-    return nullptr;
+    return it->second;
 }
 
 static const std::list<sink*>
-sink_select (const nlohmann::json& req)
+sink_select (const request& req)
 {
-    syslog (LOG_DEBUG, "[sink_select] %s", req.dump().c_str());
-
     std::list<sink*> selected;
 
     // case: sinks specified
-    if (req.find ("sinks") != req.end ())
+    if (req.sinks_specified)
     {
-        const nlohmann::json seq = req["sinks"];
-        if (!seq.is_array ())
-        {
-            syslog (LOG_ERR, "invalid sinks");
-            return selected;
-        }
-        for (const std::string& name : seq)
+        for (const std::string& name : req.sink_names)
         {
             sink* s = sink_find (name);
             if (!s) continue;
@@ -238,113 +260,368 @@ sink_select (const nlohmann::json& req)
 }
 
 // --------------------------------------------------------------------------------
-// request handling
+// thread pool
 // --------------------------------------------------------------------------------
 
-// shared variables
-std::queue<nlohmann::json*> g_requests;
-std::mutex g_mutex;
+std::vector<std::thread*> g_workers; // pool of worker threads
 
-static bool
-req_empty ()
+typedef task_queue::task_t task_t;
+  // order b.w. tasks is not preserved in their execution by workers.
+  // tasks of higher priority are dequeued first (see task_queue::lane_to_serve)
+task_queue g_taskq (64, task_queue::DROP_OLDEST);  // see "queue" in conf
+
+static int
+task_enqueue (task_t task, int prio = task_queue::NORMAL, const std::function<void()>& on_drop = nullptr)
 {
-    return (g_requests.empty());
+    return g_taskq.push (task, prio, on_drop);
 }
 
-int
-tts_server::req_enqueue (json* req)
+// blocking -- waits until a task becomes available
+static int
+task_dequeue (task_t& task)
 {
-    g_mutex.lock ();
-    g_requests.push (req);
-    g_mutex.unlock ();
+    return g_taskq.pop (task);
+}
+
+static void thread_work ();
+
+// non-blocking
+static int
+workers_run (const int n = 0)
+{
+    const int nworker = (n > 0) ? n : std::thread::hardware_concurrency();
+    for (int i = 0; i < nworker; i++)
+    {
+        std::thread* worker = new std::thread (thread_work);
+        g_workers.push_back (worker);
+    }
     return 0;
 }
 
-static json*
-req_dequeue ()
+// worker
+static void
+thread_work ()
 {
-    if (req_empty()) return nullptr;
+    task_t task;
+    int err = 0;
 
-    g_mutex.lock ();
-    json* req = g_requests.front ();
-    g_requests.pop ();
-    g_mutex.unlock ();
+    while (1)
+    {
+        err = task_dequeue (task);
+        if (err) continue;
 
-    return req;
+        err = task ();
+        if (err)
+        {
+            syslog (LOG_ERR, "[thread_work] task error");
+        }
+    }
 }
 
 // --------------------------------------------------------------------------------
-// thread pool
+// deduplication
 // --------------------------------------------------------------------------------
 
-std::vector<std::thread*> g_workers; // pool of worker threads
+// single-flight: cache key -> the stream of the request being synthesized (the leader)
+// identical requests arriving meanwhile (followers) read the leader's stream instead of synthesizing.
+std::unordered_map<std::string, audio_stream_ptr> g_inflight;
+std::mutex g_inflight_mutex;
 
-typedef std::function<int(void)> task_t;
-  // order b.w. tasks is not preserved in their execution by workers.
-std::queue<task_t> g_taskq;
-std::mutex g_taskq_mutex;
-//std::condition_variable g_taskq_cv;
+// idempotency window: request id -> time of its first delivery
+// redeliveries (e.g. mqtt qos 1) of the same id within the window are dropped at req_enqueue.
+std::unordered_map<std::string, std::chrono::steady_clock::time_point> g_seen;
+std::deque<std::pair<std::chrono::steady_clock::time_point, std::string>> g_seen_order;  // oldest first
+std::mutex g_seen_mutex;
+std::chrono::milliseconds g_dedup_window (0);  // 0 = disabled (see "dedup" in conf)
+
+// counters
+std::atomic<uint64_t> g_dedup_leaders (0);	// synthesized
+std::atomic<uint64_t> g_dedup_coalesced (0);	// attached to an in-flight synthesis
+std::atomic<uint64_t> g_dedup_dropped (0);	// duplicate deliveries
 
+// conf = {"window_ms": 10000}
 static int
-task_enqueue (task_t task)
+dedup_configure (const json& conf)
 {
+    syslog (LOG_NOTICE, "[dedup] %s", conf.dump().c_str());
+    if (!conf.is_object ()) return -1;
+    if (conf.find ("window_ms") != conf.end ())
     {
-        std::unique_lock<std::mutex> lock(g_taskq_mutex);
-        g_taskq.push (task);
+        if (!conf["window_ms"].is_number_integer () || conf["window_ms"].get<int>() < 0) return -1;
+        g_dedup_window = std::chrono::milliseconds (conf["window_ms"].get<int>());
+    }
+    return 0;
+}
+
+// true if id has been seen within the window (otherwise, id is recorded)
+static bool
+dedup_seen (const std::string& id)
+{
+    if (id.empty () || g_dedup_window.count () == 0) return false;
+
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+    std::unique_lock<std::mutex> lock (g_seen_mutex);
+
+    // expiry
+    while (!g_seen_order.empty () && now - g_seen_order.front().first >= g_dedup_window)
+    {
+        std::unordered_map<std::string, std::chrono::steady_clock::time_point>::iterator it =
+            g_seen.find (g_seen_order.front().second);
+        if (it != g_seen.end () && it->second == g_seen_order.front().first) g_seen.erase (it);
+        g_seen_order.pop_front ();
     }
-    //g_taskq_cv.notify_one();  // allows the waiting worker to dequeue
 
-    return (0);
+    if (g_seen.find (id) != g_seen.end ()) return true;
+    g_seen[id] = now;
+    g_seen_order.emplace_back (now, id);
+    return false;
 }
 
-static int
-task_dequeue (task_t& task)
+// id is forgotten (its request was not queued after all, or was evicted), so that a retry is accepted
+static void
+dedup_forget (const std::string& id)
+{
+    if (id.empty () || g_dedup_window.count () == 0) return;
+
+    std::unique_lock<std::mutex> lock (g_seen_mutex);
+    g_seen.erase (id);  // the entry in g_seen_order expires as stale
+}
+
+static json
+dedup_stats ()
 {
+    json s;
     {
-        std::unique_lock<std::mutex> lock(g_taskq_mutex);
-        if (g_taskq.empty ()) return -1;
-        task = g_taskq.front();
-        g_taskq.pop();
+        std::unique_lock<std::mutex> lock (g_inflight_mutex);
+        s["inflight"] = g_inflight.size ();
     }
-    return 0;
+    s["leaders"] = g_dedup_leaders.load ();
+    s["coalesced"] = g_dedup_coalesced.load ();
+    s["dropped"] = g_dedup_dropped.load ();
+    return s;
 }
 
-static void thread_work ();
+// --------------------------------------------------------------------------------
+// request handling
+// --------------------------------------------------------------------------------
 
-// non-blocking
+// helper
+static int process_request (request* req);
+
+// called by listeners (from their own threads)
+// each request is handed over directly to the worker pool, with no intermediate queue
+// returns task_queue::QUEUED, DROPPED, or REJECTED (when the queue is full)
+int
+tts_server::req_enqueue (request* req)
+{
+    if (!req) return -1;
+
+    // duplicate delivery
+    // (the id is claimed here, so that concurrent duplicates are caught, and released unless queued)
+    if (dedup_seen (req->id))
+    {
+        syslog (LOG_INFO, "[req_enqueue] duplicate dropped: id=\"%s\"", req->id.c_str());
+        g_dedup_dropped++;
+        delete req;
+        return task_queue::DROPPED;
+    }
+
+    // sink names -> sinks
+    req->sinks = sink_select (*req);
+    const int prio = req->priority;
+
+    // req is deallocated along with the task, even when the task is dropped from the queue
+    const std::shared_ptr<request> r (req);
+    const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now ();
+    task_t task = [r, t0]()
+        {
+            const long wait_us = std::chrono::duration_cast<std::chrono::microseconds>
+                (std::chrono::steady_clock::now () - t0).count ();
+            syslog (LOG_DEBUG, "[req_enqueue] dispatched after %ldus", wait_us);
+
+            return process_request (r.get ());
+        };
+    const std::string id = req->id;
+    const int rslt = task_enqueue (task, prio, [id]() { dedup_forget (id); });
+    if (rslt != task_queue::QUEUED) dedup_forget (id);
+    return rslt;
+}
+
+// --------------------------------------------------------------------------------
+// audio cache
+// --------------------------------------------------------------------------------
+
+audio_cache g_cache;  // disabled unless "cache" is in conf
+disk_cache g_disk_cache;  // disabled unless "cache" has "directory"
+
+static bool
+cache_enabled ()
+{
+    return g_cache.enabled () || g_disk_cache.enabled ();
+}
+
+static std::string
+cache_key (const synthesizer* synth, const request& req)
+{
+    return synth->name + '\0' + req.key ();
+}
+
+// memory, then disk (a disk hit is promoted to memory)
+static audio_ptr
+cache_find (const std::string& key)
+{
+    audio_ptr wav;
+    if (g_cache.enabled ())
+        wav = g_cache.find (key);
+    if (!wav && g_disk_cache.enabled ())
+    {
+        wav = g_disk_cache.find (key);
+        if (wav && g_cache.enabled ()) g_cache.insert (key, wav);
+    }
+    return wav;
+}
+
+static void
+cache_insert (const std::string& key, const audio_ptr& wav)
+{
+    if (g_cache.enabled ()) g_cache.insert (key, wav);
+    if (g_disk_cache.enabled ()) g_disk_cache.insert (key, wav);
+}
+
+// --------------------------------------------------------------------------------
+// pre-rendering (of phrases known ahead of time, into the cache)
+// --------------------------------------------------------------------------------
+
+std::vector<request> g_prerender;	// see "prerender" in conf
+
+// progress -- g_prerender_ready is set once all the phrases have been tried
+std::atomic<int> g_prerender_rendered (0);	// synthesized
+std::atomic<int> g_prerender_cached (0);	// found in the cache already
+std::atomic<int> g_prerender_failed (0);
+std::atomic<bool> g_prerender_ready (false);
+
+static json
+prerender_stats ()
+{
+    json s;
+    s["phrases"] = g_prerender.size ();
+    s["rendered"] = g_prerender_rendered.load ();
+    s["cached"] = g_prerender_cached.load ();
+    s["failed"] = g_prerender_failed.load ();
+    s["ready"] = g_prerender_ready.load ();
+    return s;
+}
+
+// conf = [{"synthesizer": .., "language": .., "gender": .., "phrases": ["..", ..]}, ..]
+// each entry is a request without "text", which is given by each of its phrases
 static int
-workers_run (const int n = 0)
+prerender_configure (const json& conf)
 {
-    const int nworker = (n > 0) ? n : std::thread::hardware_concurrency();
-    for (int i = 0; i < nworker; i++)
+    if (!conf.is_array ()) return -1;
+    for (const json& spec : conf)
     {
-        std::thread* worker = new std::thread (thread_work);
-        g_workers.push_back (worker);
+        if (!spec.is_object () || spec.find ("phrases") == spec.end () || !spec["phrases"].is_array ())
+        {
+            syslog (LOG_ERR, "[prerender] invalid entry: %s", spec.dump().c_str());
+            return -1;
+        }
+        json base = spec;
+        base.erase ("phrases");
+        for (const json& phrase : spec["phrases"])
+        {
+            if (!phrase.is_string ()) return -1;
+            base["text"] = phrase;
+            request r;
+            if (r.parse (base))
+            {
+                syslog (LOG_ERR, "[prerender] invalid request: %s", base.dump().c_str());
+                return -1;
+            }
+            g_prerender.push_back (r);
+        }
     }
     return 0;
 }
 
-// worker
+// one phrase at a time, so as not to crowd out live requests
 static void
-thread_work ()
+thread_prerender ()
 {
-    task_t task;
-    int err = 0;
+    syslog (LOG_NOTICE, "[prerender] %d phrases", (int)g_prerender.size ());
 
-    while (1)
+    for (const request& req : g_prerender)
     {
-        err = task_dequeue (task);
-        if (err)
+        synthesizer* synth = synth_find (req);
+        if (!synth)
+        {
+            g_prerender_failed++;
+            continue;
+        }
+        const std::string key = cache_key (synth, req);
+        if (cache_find (key))
         {
-            std::this_thread::sleep_for (std::chrono::milliseconds (100));
+            g_prerender_cached++;
             continue;
         }
 
-        err = task ();
-        if (err)
+        audio_ptr wav;
+        if (synth->synthesize (req, wav) || !wav)
         {
-            syslog (LOG_ERR, "[thread_work] task error");
+            syslog (LOG_ERR, "[prerender] synthesis failed: \"%s\"", req.text.c_str());
+            g_prerender_failed++;
+            continue;
         }
+        cache_insert (key, wav);
+        g_prerender_rendered++;
+    }
+
+    // readiness
+    g_prerender_ready = true;
+    json status;
+    status["ready"] = true;
+    status["prerender"] = prerender_stats ();
+    syslog (LOG_NOTICE, "[prerender] ready: %s", status["prerender"].dump().c_str());
+    for (listener* l : _listeners) l->publish (status);
+}
+
+// --------------------------------------------------------------------------------
+// statistics
+// --------------------------------------------------------------------------------
+
+int g_stats_interval = 0;  // sec (0 = no periodic report)
+
+json
+tts_server::stats ()
+{
+    json s;
+    s["queue"] = g_taskq.stats ();
+    s["cache"] = g_cache.stats ();
+    s["dedup"] = dedup_stats ();
+    for (const sink* k : _sinks) s["sinks"][k->name] = k->stats ();
+    for (const synthesizer* synth : _synthesizers)
+    {
+        const synth_pool* pool = dynamic_cast<const synth_pool*> (synth);
+        if (pool) s["synthesizers"][pool->name] = pool->stats ();
+        const synth_gcloud* gcloud = dynamic_cast<const synth_gcloud*> (synth);
+        if (gcloud) s["synthesizers"][gcloud->name] = gcloud->stats ();
+    }
+    if (g_disk_cache.enabled ()) s["disk_cache"] = g_disk_cache.stats ();
+    if (!g_prerender.empty ()) s["prerender"] = prerender_stats ();
+    return s;
+}
+
+// reports stats to syslog and to the listeners (as a status event)
+static void
+thread_report ()
+{
+    while (1)
+    {
+        std::this_thread::sleep_for (std::chrono::seconds (g_stats_interval));
+
+        json status;
+        status["stats"] = tts_server::stats ();
+        syslog (LOG_NOTICE, "[stats] %s", status["stats"].dump().c_str());
+        for (listener* l : _listeners) l->publish (status);
     }
 }
 
@@ -356,37 +633,45 @@ thread_work ()
 int
 tts_server::setup (const json& conf)
 {
-    // inputs
-    if (conf.find ("inputs") != conf.end ())
+    // synthesizers
+    if (conf.find ("synthesizers") != conf.end ())
     {
-        json seq = conf["inputs"];
-        // for now, seq should be a singleton
+        json seq = conf["synthesizers"];
         assert (seq.is_array ());
-        for (json& s : seq)
-        {
-            assert (s.is_object ());
-            lstnr_add (s);
-        }
+        // those run by worker processes are created first, so as to fork before any thread is started
+        // or any connection is made (the inputs come next, so that workers do not inherit their sockets)
+        // (the order of seq is kept in _synthesizers)
+        std::vector<synthesizer*> synths (seq.size (), nullptr);
+        for (int pass = 0; pass < 2; pass++)
+            for (size_t i = 0; i < seq.size (); i++)
+            {
+                assert (seq[i].is_object ());
+                if (synth_pool::pooled (seq[i]) == (pass == 0)) synths[i] = synth_add (seq[i]);
+            }
+        for (synthesizer* synth : synths)
+            if (synth) _synthesizers.push_back (synth);
     }
     // fallback
-    if (_listeners.empty ())
+    if (_synthesizers.empty ())
     {
         return -1;
     }
+    g_routes.build (_synthesizers);
 
-    // synthesizers
-    if (conf.find ("synthesizers") != conf.end ())
+    // inputs
+    if (conf.find ("inputs") != conf.end ())
     {
-        json seq = conf["synthesizers"];
+        json seq = conf["inputs"];
+        // for now, seq should be a singleton
         assert (seq.is_array ());
         for (json& s : seq)
         {
             assert (s.is_object ());
-            synth_add (s);
+            lstnr_add (s);
         }
     }
     // fallback
-    if (_synthesizers.empty ())
+    if (_listeners.empty ())
     {
         return -1;
     }
@@ -408,6 +693,42 @@ tts_server::setup (const json& conf)
         return -1;
     }
 
+    // request queue
+    if (conf.find ("queue") != conf.end ())
+    {
+        if (g_taskq.configure (conf["queue"])) return -1;
+    }
+
+    // audio cache
+    if (conf.find ("cache") != conf.end ())
+    {
+        if (g_cache.configure (conf["cache"])) return -1;
+        if (g_disk_cache.configure (conf["cache"])) return -1;
+    }
+
+    // deduplication
+    if (conf.find ("dedup") != conf.end ())
+    {
+        if (dedup_configure (conf["dedup"])) return -1;
+    }
+
+    // pre-rendering (in the background; see g_prerender_ready)
+    if (conf.find ("prerender") != conf.end ())
+    {
+        if (prerender_configure (conf["prerender"])) return -1;
+        if (!cache_enabled ())
+            syslog (LOG_WARNING, "[prerender] skipped: no cache enabled");
+        else if (!g_prerender.empty ())
+            std::thread (thread_prerender).detach ();
+    }
+
+    // statistics (reported periodically)
+    if (conf.find ("stats_interval") != conf.end ())
+    {
+        assert (conf["stats_interval"].is_number ());
+        g_stats_interval = conf["stats_interval"];
+    }
+
     return 0;
 }
 
@@ -492,66 +813,130 @@ tts_server::quit (int sig)
 // service function (main loop)
 // --------------------------------------------------------------------------------
 
-// helper
-static int process_request (json* req);
-
 // blocking
 int
 tts_server::run ()
 {
     syslog (LOG_DEBUG, "[run]");
 
-    // listeners (who put requests into the request queue)
-    for (listener* l : _listeners) l->run();
-
-    // workers (who extract requests and call process_requet for their processing)
+    // workers (who wait for tasks and call process_requet for their processing)
     //int nworker = std::thread::hardware_concurrency();
     int nworker = 2;
     workers_run (nworker);
     syslog (LOG_INFO, "[tts_server::run] %d workers invoked", nworker);
 
+    // listeners (who hand requests over to the workers)
+    for (listener* l : _listeners) l->run();
+
+    // periodic report of stats
+    if (g_stats_interval > 0)
+        new std::thread (thread_report);
+
     // blocking
-    while (1)
-    {
-        if (req_empty())
-        {
-            std::this_thread::sleep_for (std::chrono::milliseconds (100));
-            continue;
-        }
+    // workers never return; the process terminates via tts_server::quit
+    for (std::thread* w : g_workers) w->join ();
 
-        // fetch the (oldest) request message
-        json* req = req_dequeue ();
-        if (!req) continue;
+    return 0;
+}
 
-        // execution of 'process_request' using a worker thread
-        task_t task = [req]() { int err = process_request (req); delete req; return err; };
-        task_enqueue (task);
+// --------------------------------------------------------------------------------
+// sentence-level splitting
+// --------------------------------------------------------------------------------
 
-#if 0
-        // async call of 'process_request' -- INEFFICIENT
-        // note: req is to be deallocated during the call
-        auto f = std::async (process_request, req);
+// sentences of a request, each synthesized by whichever thread claims it first
+struct split_job
+{
+    synthesizer* synth;
+    std::vector<request> segs;
+    std::vector<audio_stream_ptr> outs;	// one stream per sentence
+    std::atomic<size_t> next;		// the next sentence to claim
+    std::atomic<bool> forwarding;	// claimed, by a helper or by the caller
+    std::promise<int> forwarded;	// result of the forwarding by a helper
+
+    // claims and synthesizes sentences until none is left
+    void run ()
+    {
+        size_t i;
+        while ((i = next++) < segs.size ())
+            synth->synthesize (segs[i], *outs[i]);
+    }
+};
 
-        // wait for completion of f (for 10sec)
-        std::future_status status = f.wait_for(std::chrono::seconds(10));
-        if (status == std::future_status::ready)
-            f.get ();  // blocking
-        else
+// sentences -> out, in order (chunks are passed on as soon as they arrive)
+static int
+split_forward (split_job& job, audio_stream& out)
+{
+    wav_format fmt0;
+    for (size_t i = 0; i < job.outs.size (); i++)
+    {
+        audio_stream::reader in (*job.outs[i]);
+        wav_format fmt;
+        if (in.format (fmt)) { out.close (-1); return -1; }
+        if (i == 0)
         {
-            assert ((int)status < 3);
-            const char* status_msgs[] = {"ready", "timeout", "deferred"};
-            syslog (LOG_ERR, "failure (%s) in process_request", status_msgs[(int)status]);
+            fmt0 = fmt;
+            out.open (fmt);
         }
-#endif
+        else if (fmt.rate != fmt0.rate || fmt.channels != fmt0.channels || fmt.bits != fmt0.bits)
+        {
+            syslog (LOG_ERR, "[split_forward] wav format changed at sentence#%d", (int)i);
+            out.close (-1);
+            return -1;
+        }
+
+        audio_ptr pcm;
+        int n;
+        while ((n = in.next (pcm)) > 0) out.write (pcm);
+        if (n < 0) { out.close (-1); return -1; }
     }
+    out.close ();
 
     return 0;
 }
 
+// synthesizes req sentence by sentence into out
+// the calling worker synthesizes sentences by itself, and idle workers lend a hand (and forward),
+// so no worker ever waits for a task that may not get dequeued.
+static int
+synthesize_split (synthesizer* synth, const request& req, audio_stream& out)
+{
+    std::shared_ptr<split_job> job = std::make_shared<split_job> ();
+    job->synth = synth;
+    job->segs = req.sentences ();
+    for (size_t i = 0; i < job->segs.size (); i++)
+        job->outs.push_back (std::make_shared<audio_stream> ());
+    job->next = 0;
+    job->forwarding = false;
+    syslog (LOG_DEBUG, "[synthesize_split] %d sentence(s)", (int)job->segs.size ());
+
+    // internal tasks: they bypass admission control, so never evict nor get rejected for user requests
+    // forwarding, by an idle worker (so that sentences are passed on while the others are synthesized);
+    // out is touched only once claimed, which is before we return
+    std::future<int> forwarded = job->forwarded.get_future ();
+    g_taskq.push_internal ([job, &out]()
+        {
+            if (!job->forwarding.exchange (true)) job->forwarded.set_value (split_forward (*job, out));
+            return 0;
+        });
+    // helpers (only for synthesizers that can run concurrently)
+    if (synth->concurrent)
+    {
+        const size_t nhelper = std::min (job->segs.size (), g_workers.size ()) - 1;
+        for (size_t i = 0; i < nhelper; i++)
+            g_taskq.push_internal ([job]() { job->run (); return 0; });
+    }
+
+    job->run ();
+
+    // no worker was idle to forward: by ourselves (all the sentences are synthesized, or being so)
+    if (!job->forwarding.exchange (true)) return split_forward (*job, out);
+    return forwarded.get ();
+}
+
 // topic = texter
-// payload = {text, language, engine, host, sinks:[..]}
+// payload = {text, language, engine, host, sinks:[..]} (compiled into req by the listener)
 static int
-process_request (json* req)
+process_request (request* req)
 {
     if (!req) return -1;
 
@@ -564,8 +949,8 @@ process_request (json* req)
     }
     assert (synth);
 
-    // select sinks
-    const std::list<sink*> sinks = sink_select (*req);
+    // sinks (resolved at req_enqueue)
+    const std::list<sink*>& sinks = req->sinks;
     if (sinks.empty ())
     {
         syslog (LOG_ERR, "no sink found");
@@ -573,35 +958,92 @@ process_request (json* req)
     }
     assert (!sinks.empty());
 
-    // call synthesizer (gRPC)
-    char filename[100];
-    std::tmpnam (filename);
-    strcat (filename, ".wav");
-    // synthesizer call (gRPC)
-    int err = synth->synthesize (*req, filename);
-    if (err)
+    // cache lookup (memory, then disk) -- a hit skips synthesis entirely
+    const std::string key = cache_key (synth, *req);
+    audio_ptr wav;
+    if (cache_enabled ()) wav = cache_find (key);
+
+    // single-flight -- on a miss, either lead the synthesis, or follow the one in flight
+    audio_stream_ptr out;
+    bool leader = false;
+    if (!wav)
     {
-        syslog (LOG_ERR, "[process_request] synthesis failed (%d)", err);
-        std::remove (filename);
-        return -1;
+        std::unique_lock<std::mutex> lock (g_inflight_mutex);
+        std::unordered_map<std::string, audio_stream_ptr>::const_iterator it = g_inflight.find (key);
+        if (it != g_inflight.end ())
+            out = it->second;
+        else
+        {
+            out = std::make_shared<audio_stream> ();
+            g_inflight.emplace (key, out);
+            leader = true;
+        }
     }
-    syslog (LOG_DEBUG, "wave file (%s) generated", filename);
+    if (!out) out = std::make_shared<audio_stream> ();
 
-    // send to pulseaudio sinks
+    // sinks are queued before synthesis, and consume the chunks of speech as they are synthesized
+    // (each sink reads the stream at its own pace, from its beginning, after the utterances queued earlier)
     syslog (LOG_NOTICE, "output to %d speaker(s)", sinks.size());
-    // output to sinks (async)
-    std::future<int> rslts[sinks.size ()];
-    int n = 0;
+    // the worker does not wait for playback; each sink reports back through done
+    const std::shared_ptr<std::atomic<int>> pending = std::make_shared<std::atomic<int>> (sinks.size ());
     for (sink* s : sinks)
     {
-        rslts[n++] = std::async (static_cast<int (sink::*)(const char*)>(&sink::consume), s, filename);
+        const std::string name = s->name;
+        s->play (out, [name, pending](int rslt)
+            {
+                if (rslt) syslog (LOG_ERR, "[process_request] failure at sink \"%s\" (%d)", name.c_str(), rslt);
+                if (--*pending == 0) syslog (LOG_DEBUG, "[process_request] delivered");
+            });
+    }
+
+    // synthesizer call -- out is closed in any case, which lets the sinks finish
+    int err = 0;
+    if (wav)
+    {
+        syslog (LOG_DEBUG, "[process_request] cache hit (%dB)", (int)wav->size ());
+        err = audio_stream::feed (*out, wav);
+    }
+    else if (leader)
+    {
+        g_dedup_leaders++;
+        // cached (if enabled) before being released, so that no identical request is synthesized again
+        // done may be called from a synthesizer's own thread (e.g. the rpc poller of synth_gcloud),
+        // which is not to be held up: the insertion (down to disk_cache's fdatasync) is left to a worker
+        const synthesizer::done_t done = [key, out](int rslt)
+            {
+                if (rslt) syslog (LOG_ERR, "[process_request] synthesis failed (%d)", rslt);
+                else if (cache_enabled ())
+                {
+                    g_taskq.push_internal ([key, out]()
+                        {
+                            cache_insert (key, out->wav ());
+                            std::unique_lock<std::mutex> lock (g_inflight_mutex);
+                            g_inflight.erase (key);
+                            return 0;
+                        });
+                    return;
+                }
+
+                std::unique_lock<std::mutex> lock (g_inflight_mutex);
+                g_inflight.erase (key);
+            };
+        if (req->split)
+        {
+            err = synthesize_split (synth, *req, *out);
+            done (err);
+        }
+        else
+            // the worker is released as soon as the synthesis is under way (e.g. an rpc in flight)
+            synth->synthesize_async (*req, out, done);
     }
-    for (int i = 0; i < n; i++)
+    else
     {
-        //rslts[i].get ();
-        try { rslts[i].get (); } catch (...) { syslog (LOG_ERR, "failure at sink#%d", i); }
+        // nothing to wait for -- the leader closes out
+        syslog (LOG_DEBUG, "[process_request] coalesced with the synthesis in flight");
+        g_dedup_coalesced++;
     }
-    std::remove (filename);
+
+    if (err) return -1;
 
     return 0;
 }
@@ -6,6 +6,7 @@
 #include <nlohmann/json.hpp>
 
 #include "listener.h"
+#include "request.h"
 #include "synthesizer.h"
 #include "sink.h"
 
@@ -19,7 +20,10 @@ int run (void);
 void quit (int sig);
 
 // helper (for listners)
-int req_enqueue (nlohmann::json*);
+int req_enqueue (request*);
+
+// counters of the request queue and the others
+nlohmann::json stats (void);
 
 }
 
@@ -1,31 +1,127 @@
 //
 
 #include "sink.h"
+#include "logger.h"
 
-#include <fcntl.h>
-#include <stdio.h>
-#include <unistd.h>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+sink::sink ()
+    : max_depth (16), _thread (nullptr), _playing (false), _played (0), _shed (0), _wait_total_us (0), _wait_max_us (0)
+{
+}
+
+int
+sink::consume (const uint8_t* wav, size_t len)
+{
+    // the caller keeps wav alive until we return
+    audio_stream_ptr s = audio_stream::of (std::make_shared<audio> (wav, len, nullptr));
+    audio_stream::reader in (*s);
+    return consume (in);
+}
 
 int
 sink::consume (const char* filename)
 {
-    int fd = open (filename, O_RDONLY);
-    if (fd < 0) return (-1);
+    std::ifstream in (filename, std::ios::in | std::ios::binary);
+    if (!in) return (-1);
 
-    int rslt = consume (fd);
-    close (fd);
+    const std::vector<uint8_t> wav ((std::istreambuf_iterator<char> (in)), std::istreambuf_iterator<char> ());
+    int rslt = consume (wav.data (), wav.size ());
 
     return (rslt);
 }
 
 int
-sink::consume (const uint8_t* wav, size_t len)
+sink::consume (audio_stream::reader& in)
+{
+    wav_format fmt;
+    if (in.format (fmt)) return (-1);
+
+    // header + chunks
+    std::vector<uint8_t> wav (WAV_HEADER_SIZE);
+    audio_ptr pcm;
+    int rslt;
+    while ((rslt = in.next (pcm)) > 0)
+        wav.insert (wav.end (), pcm->data (), pcm->data () + pcm->size ());
+    if (rslt < 0) return (-1);
+    wav_header (wav.data (), fmt, wav.size () - WAV_HEADER_SIZE);
+
+    return consume (wav.data (), wav.size ());
+}
+
+void
+sink::play (const audio_stream_ptr& s, done_t done)
+{
+    {
+        std::unique_lock<std::mutex> lock (_play_mutex);
+        if (max_depth > 0 && _deliveries.size () >= max_depth)
+        {
+            // shed rather than block: a producer blocked here may hold back the streams queued before
+            _shed++;
+            lock.unlock ();
+            syslog (LOG_WARNING, "[sink::play] %s: queue full (%d), utterance shed", name.c_str(), (int)max_depth);
+            if (done) done (-1);
+            return;
+        }
+        _deliveries.push_back (delivery { s, done, std::chrono::steady_clock::now () });
+        if (!_thread) _thread = new std::thread (&sink::thread_deliver, this);
+    }
+    _play_cv.notify_one ();
+}
+
+// delivery thread (one per sink, never returns)
+void
+sink::thread_deliver ()
+{
+    while (1)
+    {
+        delivery d;
+        uint64_t wait_us;
+        {
+            std::unique_lock<std::mutex> lock (_play_mutex);
+            _play_cv.wait (lock, [this]() { return !_deliveries.empty (); });
+            d = _deliveries.front ();
+            _deliveries.pop_front ();
+            _playing = true;
+
+            wait_us = std::chrono::duration_cast<std::chrono::microseconds>
+                (std::chrono::steady_clock::now () - d.t0).count ();
+            if (wait_us > _wait_max_us) _wait_max_us = wait_us;
+        }
+
+        int rslt = -1;
+        try
+        {
+            audio_stream::reader in (*d.stream);
+            rslt = consume (in);
+        }
+        catch (...) {}
+
+        {
+            std::unique_lock<std::mutex> lock (_play_mutex);
+            _playing = false;
+            // together, for wait_avg_us
+            _played++;
+            _wait_total_us += wait_us;
+        }
+
+        if (d.done) d.done (rslt);
+    }
+}
+
+nlohmann::json
+sink::stats () const
 {
-    FILE* f = fmemopen ((uint8_t*)wav, len, "r");
-    if (!f) return -1;
-    int fd = fileno (f);
-    int rslt = consume (fd);
-    fclose (f);
+    std::unique_lock<std::mutex> lock (_play_mutex);
 
-    return rslt;
+    nlohmann::json s;
+    s["depth"] = _deliveries.size () + (_playing ? 1 : 0);
+    s["played"] = _played;
+    s["shed"] = _shed;
+    s["wait_avg_us"] = _played ? _wait_total_us / _played : 0;
+    s["wait_max_us"] = _wait_max_us;
+    return s;
 }
@@ -3,20 +3,69 @@
 #ifndef TTS_SINK_H
 #define TTS_SINK_H
 
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <nlohmann/json.hpp>
+
+#include "audio_stream.h"
 
 // sink of speech data stream
 class sink
 {
 public:
-    virtual int consume (int fd) = 0;
-    virtual int consume (const char* wavfile);
+    sink ();
+    virtual ~sink () {}
+
+    // a sink overrides at least one of the two below, each of which defaults to the other:
+    // the whole wav (by default, as a stream of a single chunk)
     virtual int consume (const uint8_t* wav, size_t len);
+    virtual int consume (const char* wavfile);
+    // chunks as they arrive (by default, waits for the whole wav)
+    virtual int consume (audio_stream::reader& in);
+
+    // ordered playback: utterances are consumed one at a time, in the order of their calls to play,
+    // by the delivery thread of the sink (the stream may still be being synthesized)
+    // non-blocking; done is called with the result of consume, on the delivery thread
+    // when max_depth deliveries are already waiting, s is shed (done is called with -1 right away)
+    typedef std::function<void(int)> done_t;
+    void play (const audio_stream_ptr& s, done_t done = nullptr);
+
+    // depth (waiting + playing), played, shed, wait_avg_us, wait_max_us
+    nlohmann::json stats () const;
 
 public:
     std::string name;
+    size_t max_depth;	// deliveries waiting at most (0 = unbounded); see "max_depth" in conf
+
+private:
+    struct delivery
+    {
+        audio_stream_ptr stream;
+        done_t done;
+        std::chrono::steady_clock::time_point t0;	// enqueued
+    };
+
+    void thread_deliver ();
+
+private:
+    mutable std::mutex _play_mutex;
+    std::condition_variable _play_cv;
+    std::deque<delivery> _deliveries;	// fifo
+    std::thread* _thread;		// started upon the first play
+    bool _playing;
+
+    // counters
+    uint64_t _played;
+    uint64_t _shed;
+    uint64_t _wait_total_us;
+    uint64_t _wait_max_us;
 };
 
 #endif
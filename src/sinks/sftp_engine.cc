@@ -0,0 +1,704 @@
+//
+
+#include "sftp_engine.h"
+#include "logger.h"
+
+#include <libssh2_sftp.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include <algorithm>
+#include <cassert>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+typedef std::chrono::steady_clock clock_type;
+
+// --------------------------------------------------------------------------------
+// target & upload
+// --------------------------------------------------------------------------------
+
+sftp_target::sftp_target ()
+    : port (22), write_size (256 * 1024), pool_size (2),
+      idle_timeout (300), keepalive (30), timeout (10)
+{
+}
+
+sftp_upload::sftp_upload (const std::string& dest)
+    : _dest (dest), _finished (false), _aborted (false), _done (false)
+{
+}
+
+void
+sftp_upload::write (const audio_ptr& bytes)
+{
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _chunks.push_back (bytes);
+    }
+    sftp_engine::instance().wake ();
+}
+
+void
+sftp_upload::finish (const audio_ptr& header)
+{
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _header = header;
+        _finished = true;
+    }
+    sftp_engine::instance().wake ();
+}
+
+void
+sftp_upload::abort ()
+{
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _aborted = true;
+    }
+    sftp_engine::instance().wake ();
+}
+
+int
+sftp_upload::wait ()
+{
+    return _rslt.get_future().get ();
+}
+
+int
+sftp_upload::next (audio_ptr& bytes)
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    if (_aborted) return -2;
+    if (!_chunks.empty ())
+    {
+        bytes = _chunks.front ();
+        _chunks.pop_front ();
+        return 1;
+    }
+    return _finished ? -1 : 0;
+}
+
+void
+sftp_upload::done (int rslt)
+{
+    if (_done) return;
+    _done = true;
+    _rslt.set_value (rslt);
+}
+
+// --------------------------------------------------------------------------------
+// session
+// --------------------------------------------------------------------------------
+
+struct sftp_engine::session
+{
+    // REOPEN: the data written, the header is written through a handle of its own
+    // SHUTDOWN, DISCONNECT: graceful close (the server is told, without blocking)
+    enum state_t { CONNECTING, HANDSHAKE, AUTH, SFTP_INIT, IDLE, OPEN, WRITE, REOPEN, HEADER, CLOSE, SHUTDOWN, DISCONNECT, DEAD };
+
+    const sftp_target* target;
+    state_t state;
+    int sock;
+    LIBSSH2_SESSION* ssh;
+    LIBSSH2_SFTP* sftp;
+    LIBSSH2_SFTP_HANDLE* handle;
+    bool registered;		// to epoll
+    uint32_t events;
+    int uses;			// uploads so far
+
+    // upload in progress
+    sftp_upload_ptr up;
+    int rslt;
+    audio_ptr piece;		// bytes being written (ptr/left within)
+    std::vector<uint8_t> gather;	// small chunks gathered into a piece
+    const uint8_t* ptr;
+    size_t left;
+
+    // timers
+    clock_type::time_point deadline;	// of setup, or of progress
+    clock_type::time_point used;	// became idle
+    clock_type::time_point alive;	// last keepalive
+
+    session (const sftp_target* t)
+        : target (t), state (CONNECTING), sock (-1), ssh (nullptr), sftp (nullptr), handle (nullptr),
+          registered (false), events (0), uses (0), rslt (0), ptr (nullptr), left (0),
+          deadline (clock_type::time_point::max ()), used (clock_type::now ()), alive (clock_type::now ())
+    {
+    }
+};
+
+// --------------------------------------------------------------------------------
+// engine
+// --------------------------------------------------------------------------------
+
+sftp_engine&
+sftp_engine::instance ()
+{
+    static sftp_engine engine;
+    return engine;
+}
+
+sftp_engine::sftp_engine ()
+{
+    if (libssh2_init (0))
+        syslog (LOG_ERR, "[sftp_engine] libssh2 initialization failed");
+
+    _epfd = epoll_create1 (EPOLL_CLOEXEC);
+    _evfd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    assert (_epfd >= 0 && _evfd >= 0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;	// nullptr: _evfd
+    epoll_ctl (_epfd, EPOLL_CTL_ADD, _evfd, &ev);
+
+    _thread = new std::thread (&sftp_engine::loop, this);
+}
+
+void
+sftp_engine::submit (const sftp_target* target, const sftp_upload_ptr& up)
+{
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _submitted.emplace_back (target, up);
+    }
+    wake ();
+}
+
+void
+sftp_engine::wake ()
+{
+    const uint64_t one = 1;
+    ssize_t n = ::write (_evfd, &one, sizeof (one));
+    (void)n;
+}
+
+// never returns
+void
+sftp_engine::loop ()
+{
+    struct epoll_event evs[64];
+    while (1)
+    {
+        // timers -> timeout of epoll_wait
+        const clock_type::time_point next = timers ();
+        int timeout = -1;
+        if (next != clock_type::time_point::max ())
+        {
+            const long ms = std::chrono::duration_cast<std::chrono::milliseconds> (next - clock_type::now ()).count ();
+            timeout = (int)std::max (0L, std::min (ms + 1, 60000L));
+        }
+
+        const int n = epoll_wait (_epfd, evs, 64, timeout);
+        if (n < 0 && errno != EINTR)
+        {
+            syslog (LOG_ERR, "[sftp_engine] epoll_wait failed: %s", strerror (errno));
+            continue;
+        }
+
+        bool woken = false;
+        for (int i = 0; i < n; i++)
+        {
+            session* s = (session*)evs[i].data.ptr;
+            if (!s)
+            {
+                uint64_t count;
+                while (::read (_evfd, &count, sizeof (count)) > 0) ;
+                woken = true;
+                continue;
+            }
+            if (s->state == session::DEAD) continue;
+
+            if (s->state == session::IDLE)
+                fail (s, "disconnected while idle");
+            else if (s->state >= session::SHUTDOWN && (evs[i].events & (EPOLLERR | EPOLLHUP)))
+                close (s, false);
+            else if ((evs[i].events & (EPOLLERR | EPOLLHUP)) && s->state != session::CONNECTING)
+                fail (s, "connection lost");
+            else
+                step (s);
+        }
+
+        if (woken)
+        {
+            // new uploads
+            std::deque<std::pair<const sftp_target*, sftp_upload_ptr>> submitted;
+            {
+                std::unique_lock<std::mutex> lock (_mutex);
+                submitted.swap (_submitted);
+            }
+            for (const std::pair<const sftp_target*, sftp_upload_ptr>& p : submitted)
+                _waiting[p.first].push_back (p.second);
+            for (const std::pair<const sftp_target*, sftp_upload_ptr>& p : submitted)
+                assign (p.first);
+
+            // new data for uploads waiting for it
+            for (session* s : _sessions)
+                if (s->state == session::WRITE && s->left == 0) step (s);
+        }
+
+        // reaping
+        for (std::list<session*>::iterator it = _sessions.begin (); it != _sessions.end (); )
+        {
+            if ((*it)->state != session::DEAD) { ++it; continue; }
+            delete *it;
+            it = _sessions.erase (it);
+        }
+    }
+}
+
+// deadlines, idle timeouts and keepalives (returns the earliest time to come back)
+std::chrono::steady_clock::time_point
+sftp_engine::timers ()
+{
+    const clock_type::time_point now = clock_type::now ();
+    clock_type::time_point next = clock_type::time_point::max ();
+
+    for (session* s : _sessions)
+    {
+        if (s->state == session::DEAD) continue;
+        const sftp_target* t = s->target;
+
+        if (s->state == session::IDLE)
+        {
+            if (now - s->used >= t->idle_timeout)
+            {
+                close (s);
+                continue;
+            }
+            if (t->keepalive.count () > 0 && now - s->alive >= t->keepalive)
+            {
+                int secs;
+                const int rc = libssh2_keepalive_send (s->ssh, &secs);
+                if (rc == LIBSSH2_ERROR_EAGAIN)
+                    next = std::min (next, now + std::chrono::milliseconds (100));  // not sent yet: retried shortly
+                else if (rc)
+                {
+                    close (s);
+                    continue;
+                }
+                else
+                    s->alive = now;
+            }
+            next = std::min (next, s->used + t->idle_timeout);
+            if (t->keepalive.count () > 0 && s->alive + t->keepalive > now) next = std::min (next, s->alive + t->keepalive);
+            continue;
+        }
+
+        if (now >= s->deadline)
+        {
+            if (s->state >= session::SHUTDOWN)
+                close (s, false);  // the server did not respond to the disconnection
+            else
+                fail (s, "timed out");
+            continue;
+        }
+        next = std::min (next, s->deadline);
+    }
+    return next;
+}
+
+// waiting uploads -> idle sessions, or new sessions (up to the pool size)
+void
+sftp_engine::assign (const sftp_target* t)
+{
+    std::deque<sftp_upload_ptr>& waiting = _waiting[t];
+    int count = 0;
+    for (session* s : _sessions)
+    {
+        if (s->target != t || s->state >= session::SHUTDOWN) continue;
+        count++;
+        if (waiting.empty ()) return;
+        if (s->state == session::IDLE) step (s);
+    }
+    if (!waiting.empty () && count < (int)std::max (t->pool_size, (size_t)1))
+        open (t);
+}
+
+// non-blocking connect (the rest follows in step)
+sftp_engine::session*
+sftp_engine::open (const sftp_target* t)
+{
+    session* s = new session (t);
+    _sessions.push_back (s);
+
+    struct sockaddr_in sin;
+    memset (&sin, 0, sizeof (sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons (t->port);
+    if (!inet_aton (t->address.c_str(), &sin.sin_addr))
+    {
+        fail (s, "invalid address");
+        return nullptr;
+    }
+    s->sock = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->sock < 0 || (connect (s->sock, (struct sockaddr*)&sin, sizeof (sin)) && errno != EINPROGRESS))
+    {
+        fail (s, "connect");
+        return nullptr;
+    }
+    s->deadline = clock_type::now () + t->timeout;
+    interest (s, EPOLLOUT);
+
+    syslog (LOG_DEBUG, "[sftp_engine] connecting to %s:%d", t->address.c_str(), t->port);
+    return s;
+}
+
+void
+sftp_engine::interest (session* s, uint32_t events)
+{
+    if (s->registered && s->events == events) return;
+    struct epoll_event ev;
+    ev.events = events;
+    ev.data.ptr = s;
+    epoll_ctl (_epfd, s->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->sock, &ev);
+    s->registered = true;
+    s->events = events;
+}
+
+// blocked by libssh2 -- wait for the socket, in the direction it is blocked in
+void
+sftp_engine::wait_io (session* s)
+{
+    const int dir = libssh2_session_block_directions (s->ssh);
+    uint32_t events = 0;
+    if (dir & LIBSSH2_SESSION_BLOCK_INBOUND) events |= EPOLLIN;
+    if (dir & LIBSSH2_SESSION_BLOCK_OUTBOUND) events |= EPOLLOUT;
+    interest (s, events ? events : EPOLLIN);
+}
+
+// the session is dropped; so is the upload on it, or the uploads waiting for it during its setup
+void
+sftp_engine::fail (session* s, const char* what)
+{
+    const sftp_target* t = s->target;
+    syslog (LOG_ERR, "[sftp_engine] %s:%d: %s (state=%d, error=%d)", t->address.c_str(), t->port, what,
+            s->state, s->ssh ? libssh2_session_last_errno (s->ssh) : errno);
+
+    if (s->up)
+    {
+        // a stale pooled session, with nothing of the upload consumed yet: the upload gets another session
+        // (a transport error only; see refused)
+        if (s->state == session::OPEN && s->uses > 0 && s->ssh && libssh2_session_last_errno (s->ssh) != LIBSSH2_ERROR_SFTP_PROTOCOL)
+            _waiting[t].push_front (s->up);
+        else
+            s->up->done (-1);
+        s->up = nullptr;
+    }
+    else if (s->state < session::IDLE)
+    {
+        // the target is unreachable
+        for (const sftp_upload_ptr& up : _waiting[t]) up->done (-1);
+        _waiting[t].clear ();
+    }
+
+    s->handle = nullptr;	// freed along with the session
+    close (s, false);
+    if (!_waiting[t].empty ()) assign (t);
+}
+
+// the server answered an sftp request with an error status (e.g. the file exists, no space left):
+// the upload fails, but the session is sound, and is kept
+void
+sftp_engine::refused (session* s, const char* what)
+{
+    const sftp_target* t = s->target;
+    syslog (LOG_ERR, "[sftp_engine] %s:%d: %s \"%s\" refused (sftp status=%lu)", t->address.c_str(), t->port, what,
+            s->up->_dest.c_str(), libssh2_sftp_last_error (s->sftp));
+    s->rslt = -1;
+    s->state = session::CLOSE;  // the handle, if any, is closed, and the session goes back to the pool
+}
+
+// graceful: the server is told first, through the SHUTDOWN and DISCONNECT states (non-blocking,
+// given up on after a second); otherwise, the session is torn down right away
+void
+sftp_engine::close (session* s, bool graceful)
+{
+    if (s->state == session::DEAD) return;
+    if (graceful && s->ssh && s->state >= session::IDLE)
+    {
+        if (s->state >= session::SHUTDOWN) return;  // under way
+        s->state = s->sftp ? session::SHUTDOWN : session::DISCONNECT;
+        s->deadline = clock_type::now () + std::chrono::seconds (1);
+        return step (s);
+    }
+    s->state = session::DEAD;
+
+    if (s->ssh) libssh2_session_free (s->ssh);
+    if (s->sock >= 0)
+    {
+        epoll_ctl (_epfd, EPOLL_CTL_DEL, s->sock, nullptr);
+        ::close (s->sock);
+    }
+    syslog (LOG_DEBUG, "[sftp_engine] session to %s closed", s->target->address.c_str());
+}
+
+// the next piece to write (status: 0 none yet, -1 end of data, -2 aborted)
+bool
+sftp_engine::next_piece (session* s, int& status)
+{
+    const size_t limit = s->target->write_size;
+    s->piece = nullptr;
+    s->gather.clear ();
+
+    audio_ptr bytes;
+    while ((status = s->up->next (bytes)) > 0)
+    {
+        // a large chunk is written as is
+        if (s->gather.empty () && bytes->size () >= limit)
+        {
+            s->piece = bytes;
+            s->ptr = bytes->data ();
+            s->left = bytes->size ();
+            return true;
+        }
+        s->gather.insert (s->gather.end (), bytes->data (), bytes->data () + bytes->size ());
+        if (s->gather.size () >= limit) break;
+    }
+    if (s->gather.empty ()) return false;
+
+    s->ptr = s->gather.data ();
+    s->left = s->gather.size ();
+    return true;
+}
+
+// runs the state machine of s until it has to wait
+void
+sftp_engine::step (session* s)
+{
+    const sftp_target* t = s->target;
+    int rc;
+
+    while (1)
+    {
+        switch (s->state)
+        {
+        case session::CONNECTING:
+        {
+            int err = 0;
+            socklen_t len = sizeof (err);
+            if (getsockopt (s->sock, SOL_SOCKET, SO_ERROR, &err, &len) || err)
+            {
+                errno = err;
+                return fail (s, "connect");
+            }
+            s->ssh = libssh2_session_init ();
+            if (!s->ssh) return fail (s, "libssh2_session_init");
+            libssh2_session_set_blocking (s->ssh, 0);
+            s->state = session::HANDSHAKE;
+            break;
+        }
+
+        case session::HANDSHAKE:
+            rc = libssh2_session_handshake (s->ssh, s->sock);
+            if (rc == LIBSSH2_ERROR_EAGAIN) return wait_io (s);
+            if (rc) return fail (s, "handshake");
+            // keepalive messages (see timers) want no reply
+            libssh2_keepalive_config (s->ssh, 0, t->keepalive.count ());
+            s->state = session::AUTH;
+            break;
+
+        case session::AUTH:
+            if (!t->publickey_path.empty () && !t->privatekey_path.empty ())
+                rc = libssh2_userauth_publickey_fromfile (s->ssh, t->username.c_str(), t->publickey_path.c_str(),
+                                                          t->privatekey_path.c_str(), t->password.c_str());
+            else
+                rc = libssh2_userauth_password (s->ssh, t->username.c_str(), t->password.c_str());
+            if (rc == LIBSSH2_ERROR_EAGAIN) return wait_io (s);
+            if (rc)
+            {
+                // special case
+                if (rc == LIBSSH2_ERROR_PUBLICKEY_UNVERIFIED)
+                    syslog (LOG_ERR, "[sftp_engine] unsupported publickey format (probably)");
+                return fail (s, "authentication");
+            }
+            s->state = session::SFTP_INIT;
+            break;
+
+        case session::SFTP_INIT:
+            s->sftp = libssh2_sftp_init (s->ssh);
+            if (!s->sftp)
+            {
+                if (libssh2_session_last_errno (s->ssh) == LIBSSH2_ERROR_EAGAIN) return wait_io (s);
+                return fail (s, "sftp_init");
+            }
+            syslog (LOG_DEBUG, "[sftp_engine] sftp session to %s started", t->address.c_str());
+            s->used = s->alive = clock_type::now ();
+            s->state = session::IDLE;
+            break;
+
+        case session::IDLE:
+        {
+            std::deque<sftp_upload_ptr>& waiting = _waiting[t];
+            if (waiting.empty ())
+            {
+                // nothing but a disconnection is watched for (whatever else the server sends is read later)
+                s->deadline = clock_type::time_point::max ();
+                return interest (s, EPOLLRDHUP);
+            }
+            s->up = waiting.front ();
+            waiting.pop_front ();
+            s->rslt = 0;
+            s->left = 0;
+            s->deadline = clock_type::now () + t->timeout;
+            s->state = session::OPEN;
+            break;
+        }
+
+        case session::OPEN:
+        {
+            const unsigned long flags = LIBSSH2_FXF_WRITE | LIBSSH2_FXF_CREAT | LIBSSH2_FXF_EXCL;
+            // R/W for user, R for group and other
+            const long mode = LIBSSH2_SFTP_S_IRUSR | LIBSSH2_SFTP_S_IWUSR | LIBSSH2_SFTP_S_IRGRP | LIBSSH2_SFTP_S_IROTH;
+            s->handle = libssh2_sftp_open (s->sftp, s->up->_dest.c_str(), flags, mode);
+            if (!s->handle)
+            {
+                const int err = libssh2_session_last_errno (s->ssh);
+                if (err == LIBSSH2_ERROR_EAGAIN) return wait_io (s);
+                if (err == LIBSSH2_ERROR_SFTP_PROTOCOL)
+                {
+                    refused (s, "sftp_open");
+                    break;
+                }
+                return fail (s, "sftp_open");
+            }
+            s->uses++;
+            s->state = session::WRITE;
+            break;
+        }
+
+        case session::WRITE:
+        case session::HEADER:
+            if (s->left == 0)
+            {
+                if (s->state == session::HEADER)
+                {
+                    s->state = session::CLOSE;
+                    break;
+                }
+                int status;
+                if (!next_piece (s, status))
+                {
+                    if (status == 0)
+                    {
+                        // waiting for data (see loop)
+                        s->deadline = clock_type::time_point::max ();
+                        return interest (s, 0);
+                    }
+                    s->rslt = (status == -1) ? 0 : -1;
+                    s->state = (status == -1) ? session::REOPEN : session::CLOSE;
+                    break;
+                }
+            }
+            rc = libssh2_sftp_write (s->handle, (const char*)s->ptr, std::min (s->left, t->write_size));
+            if (rc == LIBSSH2_ERROR_EAGAIN)	// ** libssh2 wants the same buffer again
+            {
+                if (s->deadline == clock_type::time_point::max ())
+                    s->deadline = clock_type::now () + t->timeout;
+                return wait_io (s);
+            }
+            if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL)
+            {
+                refused (s, "sftp_write");
+                break;
+            }
+            if (rc < 0) return fail (s, "sftp_write");
+            s->ptr += rc;
+            s->left -= rc;
+            s->deadline = clock_type::now () + t->timeout;
+            break;
+
+        case session::REOPEN:
+        {
+            // header with the actual sizes, at offset 0
+            // no seek on the data handle (which would discard the acks of pipelined writes still in flight):
+            // the data handle is closed, which waits for them all and reports their failures, and the header
+            // goes through a new handle
+            if (s->handle)
+            {
+                rc = libssh2_sftp_close (s->handle);
+                if (rc == LIBSSH2_ERROR_EAGAIN) return wait_io (s);
+                s->handle = nullptr;
+                if (rc == LIBSSH2_ERROR_SFTP_PROTOCOL)
+                {
+                    refused (s, "sftp_close");
+                    break;
+                }
+                if (rc) return fail (s, "sftp_close");
+            }
+            audio_ptr header;
+            {
+                std::unique_lock<std::mutex> lock (s->up->_mutex);
+                header = s->up->_header;
+            }
+            if (!header)
+            {
+                s->state = session::CLOSE;
+                break;
+            }
+            s->handle = libssh2_sftp_open (s->sftp, s->up->_dest.c_str(), LIBSSH2_FXF_WRITE, 0);
+            if (!s->handle)
+            {
+                const int err = libssh2_session_last_errno (s->ssh);
+                if (err == LIBSSH2_ERROR_EAGAIN) return wait_io (s);
+                if (err == LIBSSH2_ERROR_SFTP_PROTOCOL)
+                {
+                    refused (s, "sftp_open");
+                    break;
+                }
+                return fail (s, "sftp_open");
+            }
+            s->piece = header;
+            s->ptr = header->data ();
+            s->left = header->size ();
+            s->state = session::HEADER;
+            break;
+        }
+
+        case session::CLOSE:
+            rc = s->handle ? libssh2_sftp_close (s->handle) : 0;
+            if (rc == LIBSSH2_ERROR_EAGAIN) return wait_io (s);
+            s->handle = nullptr;
+            s->piece = nullptr;
+            s->gather.clear ();
+            syslog (LOG_DEBUG, "[sftp_engine] upload of \"%s\" done (%d)", s->up->_dest.c_str(), s->rslt);
+            s->up->done (rc ? -1 : s->rslt);
+            s->up = nullptr;
+            if (rc && rc != LIBSSH2_ERROR_SFTP_PROTOCOL) return fail (s, "sftp_close");
+
+            // back to the pool, unless it is full
+            s->used = clock_type::now ();
+            s->state = session::IDLE;
+            if (_waiting[t].empty ())
+            {
+                size_t idle = 0;
+                for (session* o : _sessions)
+                    if (o->target == t && o->state == session::IDLE) idle++;
+                if (idle > t->pool_size) return close (s);
+            }
+            break;
+
+        case session::SHUTDOWN:
+            rc = libssh2_sftp_shutdown (s->sftp);
+            if (rc == LIBSSH2_ERROR_EAGAIN) return wait_io (s);
+            s->sftp = nullptr;
+            s->state = session::DISCONNECT;
+            break;
+
+        case session::DISCONNECT:
+            rc = libssh2_session_disconnect (s->ssh, "disconnected");
+            if (rc == LIBSSH2_ERROR_EAGAIN) return wait_io (s);
+            return close (s, false);
+
+        case session::DEAD:
+            return;
+        }
+    }
+}
@@ -0,0 +1,112 @@
+//
+
+#ifndef TTS_SFTP_ENGINE_H
+#define TTS_SFTP_ENGINE_H
+
+#include "audio.h"
+
+#include <chrono>
+#include <deque>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// remote host, and how its sessions are set up and pooled
+struct sftp_target
+{
+    std::string address;	// ip addr
+    int port;			// tcp port (22)
+
+    // authentication info
+    std::string username;
+    std::string publickey_path;
+    std::string privatekey_path;
+    std::string password;
+
+    size_t write_size;		// bytes per libssh2_sftp_write
+    size_t pool_size;		// max idle sessions (at least one session is open while uploading)
+    std::chrono::seconds idle_timeout;
+    std::chrono::seconds keepalive;	// interval
+    std::chrono::seconds timeout;	// connection setup, and any stall in between
+
+    sftp_target ();
+};
+
+// a file upload, fed by its caller and carried out by the engine
+class sftp_upload
+{
+public:
+    sftp_upload (const std::string& dest);
+
+    // caller (all non-blocking but wait)
+    void write (const audio_ptr& bytes);	// queued, not copied
+    void finish (const audio_ptr& header);	// end of data; header overwrites the beginning of the file
+    void abort ();
+    int wait ();				// blocking: 0 on success
+
+private:
+    friend class sftp_engine;
+
+    // 1: bytes, 0: none yet, -1: end of data, -2: aborted
+    int next (audio_ptr& bytes);
+    void done (int rslt);
+
+    std::string _dest;
+    std::mutex _mutex;
+    std::deque<audio_ptr> _chunks;
+    bool _finished;
+    bool _aborted;
+    audio_ptr _header;
+    std::promise<int> _rslt;
+    bool _done;
+};
+
+typedef std::shared_ptr<sftp_upload> sftp_upload_ptr;
+
+// non-blocking sftp transport: one thread, one epoll loop, for the sessions and uploads of all the sftp sinks
+// sessions and uploads are state machines, stepped whenever their socket is ready or new data arrives.
+class sftp_engine
+{
+public:
+    static sftp_engine& instance ();
+
+    // upload to target (which must outlive the engine)
+    void submit (const sftp_target* target, const sftp_upload_ptr& up);
+    void wake ();
+
+private:
+    struct session;
+
+    sftp_engine ();
+    void loop ();
+
+    // (engine thread)
+    void assign (const sftp_target* t);
+    session* open (const sftp_target* t);
+    void step (session* s);
+    void wait_io (session* s);
+    void interest (session* s, uint32_t events);
+    void fail (session* s, const char* what);
+    void refused (session* s, const char* what);
+    void close (session* s, bool graceful = true);
+    bool next_piece (session* s, int& status);
+    std::chrono::steady_clock::time_point timers ();
+
+private:
+    int _epfd;
+    int _evfd;			// wake-ups (eventfd)
+    std::thread* _thread;
+
+    std::mutex _mutex;
+    std::deque<std::pair<const sftp_target*, sftp_upload_ptr>> _submitted;
+
+    // (engine thread)
+    std::list<session*> _sessions;
+    std::map<const sftp_target*, std::deque<sftp_upload_ptr>> _waiting;
+};
+
+#endif
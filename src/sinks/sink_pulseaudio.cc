@@ -1,21 +1,210 @@
 //
 
 #include "sink_pulseaudio.h"
+#include "audio.h"
 #include "logger.h"
 
-#include <pulse/simple.h>
-#include <pulse/error.h>
+#include <pulse/pulseaudio.h>
 
 #include <cassert>
-#include <fcntl.h>
-#include <iostream>
+#include <map>
+#include <mutex>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
-#include <unistd.h>
 
+// --------------------------------------------------------------------------------
+// connection to a pulseaudio server
+// --------------------------------------------------------------------------------
+
+// a context run by its own threaded mainloop
+// pa_* calls on the context and its streams are made with the mainloop locked;
+// callbacks (run on the mainloop thread) signal the waiters.
+struct pulse_server
+{
+    std::string address;
+    pa_threaded_mainloop* loop;
+    pa_context* ctx;
+    bool quitting;
+
+    pulse_server (const std::string& addr);
+    ~pulse_server ();
+
+    void connect ();	// non-blocking
+    int wait_ready ();	// blocking (0: ready, -1: failed, reconnection pending)
+};
+
+static const pa_usec_t RECONNECT_DELAY = 1 * PA_USEC_PER_SEC;
+
+static void
+cb_reconnect (pa_mainloop_api* api, pa_time_event* e, const struct timeval*, void* user)
+{
+    api->time_free (e);
+    pulse_server* server = (pulse_server*)user;
+    syslog (LOG_NOTICE, "[pulse_server] reconnecting to %s", server->address.c_str());
+    server->connect ();
+}
+
+static void
+cb_context_state (pa_context* ctx, void* user)
+{
+    pulse_server* server = (pulse_server*)user;
+    const pa_context_state_t state = pa_context_get_state (ctx);
+
+    if ((state == PA_CONTEXT_FAILED || state == PA_CONTEXT_TERMINATED) && !server->quitting)
+    {
+        syslog (LOG_ERR, "[pulse_server] connection to %s lost: %s",
+                server->address.c_str(), pa_strerror (pa_context_errno (ctx)));
+        // retry later
+        pa_mainloop_api* api = pa_threaded_mainloop_get_api (server->loop);
+        struct timeval tv;
+        pa_timeval_add (pa_gettimeofday (&tv), RECONNECT_DELAY);
+        api->time_new (api, &tv, cb_reconnect, server);
+    }
+    pa_threaded_mainloop_signal (server->loop, 0);
+}
+
+pulse_server::pulse_server (const std::string& addr)
+    : address (addr), ctx (nullptr), quitting (false)
+{
+    loop = pa_threaded_mainloop_new ();
+    assert (loop);
+    pa_threaded_mainloop_start (loop);
+
+    pa_threaded_mainloop_lock (loop);
+    connect ();
+    pa_threaded_mainloop_unlock (loop);
+}
+
+pulse_server::~pulse_server ()
+{
+    pa_threaded_mainloop_lock (loop);
+    quitting = true;
+    if (ctx)
+    {
+        pa_context_disconnect (ctx);
+        pa_context_unref (ctx);
+    }
+    pa_threaded_mainloop_unlock (loop);
+
+    pa_threaded_mainloop_stop (loop);
+    pa_threaded_mainloop_free (loop);
+}
+
+// (with the mainloop locked)
+void
+pulse_server::connect ()
+{
+    if (ctx)
+    {
+        pa_context_set_state_callback (ctx, nullptr, nullptr);
+        pa_context_unref (ctx);
+    }
+
+    ctx = pa_context_new (pa_threaded_mainloop_get_api (loop), "tts_server");
+    assert (ctx);
+    pa_context_set_state_callback (ctx, cb_context_state, this);
+    if (pa_context_connect (ctx, address.c_str(), PA_CONTEXT_NOFLAGS, nullptr) < 0)
+        syslog (LOG_ERR, "[pulse_server] pa_context_connect (server=\"%s\") failed: %s",
+                address.c_str(), pa_strerror (pa_context_errno (ctx)));
+}
+
+// (with the mainloop locked)
+int
+pulse_server::wait_ready ()
+{
+    while (1)
+    {
+        switch (pa_context_get_state (ctx))
+        {
+        case PA_CONTEXT_READY:
+            return 0;
+        case PA_CONTEXT_FAILED:
+        case PA_CONTEXT_TERMINATED:
+            return -1;
+        default:
+            pa_threaded_mainloop_wait (loop);
+        }
+    }
+}
+
+// servers by address, shared by sinks
+static std::map<std::string, std::weak_ptr<pulse_server>> g_servers;
+static std::mutex g_servers_mutex;
+
+static std::shared_ptr<pulse_server>
+server_get (const std::string& address)
+{
+    std::unique_lock<std::mutex> lock (g_servers_mutex);
+    std::shared_ptr<pulse_server> server = g_servers[address].lock ();
+    if (!server)
+    {
+        server = std::make_shared<pulse_server> (address);
+        g_servers[address] = server;
+    }
+    return server;
+}
+
+// --------------------------------------------------------------------------------
+// stream helpers
+// --------------------------------------------------------------------------------
+
+static void
+cb_stream_notify (pa_stream*, void* loop)
+{
+    pa_threaded_mainloop_signal ((pa_threaded_mainloop*)loop, 0);
+}
+
+static void
+cb_stream_request (pa_stream*, size_t, void* loop)
+{
+    pa_threaded_mainloop_signal ((pa_threaded_mainloop*)loop, 0);
+}
+
+static void
+cb_stream_success (pa_stream*, int, void* loop)
+{
+    pa_threaded_mainloop_signal ((pa_threaded_mainloop*)loop, 0);
+}
+
+// blocking, with the mainloop locked (op is cancelled when its stream dies, which also signals)
+static int
+op_wait (pa_threaded_mainloop* loop, pa_operation* op)
+{
+    if (!op) return -1;
+    while (pa_operation_get_state (op) == PA_OPERATION_RUNNING)
+        pa_threaded_mainloop_wait (loop);
+    const int rslt = (pa_operation_get_state (op) == PA_OPERATION_DONE) ? 0 : -1;
+    pa_operation_unref (op);
+    return rslt;
+}
+
+static uint32_t
+ms2bytes (int ms, const pa_sample_spec& ss)
+{
+    return (ms < 0) ? (uint32_t)-1 : (uint32_t)pa_usec_to_bytes ((pa_usec_t)ms * PA_USEC_PER_MSEC, &ss);
+}
+
+static pa_sample_spec
+sample_spec (const wav_format& fmt)
+{
+    const pa_sample_spec ss =
+        {
+         .format = (fmt.bits == 8) ? PA_SAMPLE_U8 : PA_SAMPLE_S16LE,
+         .rate = (uint32_t)fmt.rate,
+         .channels = (uint8_t)fmt.channels
+        };
+    return ss;
+}
+
+// --------------------------------------------------------------------------------
+// sink
+// --------------------------------------------------------------------------------
+
+// spec = {name, host, device, cork, buffer: {maxlength_ms, tlength_ms, prebuf_ms, minreq_ms}}
 sink_pulseaudio::sink_pulseaudio (const nlohmann::json& spec)
+    : _stream (nullptr), _cork (true), _maxlength_ms (-1), _tlength_ms (-1), _prebuf_ms (-1), _minreq_ms (-1)
 {
     // host
     assert (spec.find ("host") != spec.end ());
@@ -30,62 +219,166 @@ sink_pulseaudio::sink_pulseaudio (const nlohmann::json& spec)
 
     // device
     _device = (spec.find ("device") != spec.end () && spec["device"].is_string ()) ? spec["device"] : "";
+
+    // stream
+    if (spec.find ("cork") != spec.end () && spec["cork"].is_boolean ())
+        _cork = spec["cork"];
+    if (spec.find ("buffer") != spec.end () && spec["buffer"].is_object ())
+    {
+        const nlohmann::json& b = spec["buffer"];
+        if (b.find ("maxlength_ms") != b.end ()) _maxlength_ms = b["maxlength_ms"];
+        if (b.find ("tlength_ms") != b.end ()) _tlength_ms = b["tlength_ms"];
+        if (b.find ("prebuf_ms") != b.end ()) _prebuf_ms = b["prebuf_ms"];
+        if (b.find ("minreq_ms") != b.end ()) _minreq_ms = b["minreq_ms"];
+    }
+
+    // connected in advance, off the path of requests
+    _server = server_get (_address);
 }
 
+sink_pulseaudio::~sink_pulseaudio ()
+{
+    pa_threaded_mainloop_lock (_server->loop);
+    stream_close ();
+    pa_threaded_mainloop_unlock (_server->loop);
+}
+
+// (with the mainloop locked)
 int
-sink_pulseaudio::consume (int fd)
+sink_pulseaudio::stream_open (const wav_format& fmt)
 {
-    syslog (LOG_DEBUG, "[play] address=%s device=\"%s\"", _address.c_str(), _device.c_str());
+    // reuse
+    if (_stream)
+    {
+        if (pa_stream_get_state (_stream) == PA_STREAM_READY
+            && pa_stream_get_context (_stream) == _server->ctx
+            && fmt.rate == _stream_fmt.rate && fmt.channels == _stream_fmt.channels && fmt.bits == _stream_fmt.bits)
+            return 0;
+        stream_close ();
+    }
 
-    // WAV header (http://soundfile.sapp.org/doc/WaveFormat/)
-    uint8_t hd[44];
-    ssize_t n = read (fd, hd, 44);
-    if (n != 44) return (-1);
-    if (strncmp ((const char*)hd, "RIFF", 4) != 0) return (-1);
-    if (strncmp ((const char*)hd + 8, "WAVE", 4) != 0) return (-1);
-    uint16_t* fmt = (uint16_t*)(hd + 20);
-    if (*fmt != 1) return (-1);
-    uint8_t* nch = (uint8_t*)(hd + 22);
-    uint16_t* rate = (uint16_t*)(hd + 24);
-    uint16_t* bps = (uint16_t*)(hd + 34);
-    if (*bps != 8 && *bps != 16) return (-1);
-    const pa_sample_spec ss =
-        {
-         .format = (*bps == 8) ? PA_SAMPLE_U8 : PA_SAMPLE_S16LE,
-         .rate = *rate,
-         .channels = *nch
-        };
+    if (_server->wait_ready ())
+    {
+        syslog (LOG_ERR, "[consume] no connection to %s", _address.c_str());
+        return -1;
+    }
+
+    const pa_sample_spec ss = sample_spec (fmt);
+    _stream = pa_stream_new (_server->ctx, "playback", &ss, nullptr);
+    if (!_stream) return -1;
+    pa_stream_set_state_callback (_stream, cb_stream_notify, _server->loop);
+    pa_stream_set_write_callback (_stream, cb_stream_request, _server->loop);
+
+    pa_buffer_attr attr;
+    attr.maxlength = ms2bytes (_maxlength_ms, ss);
+    attr.tlength = ms2bytes (_tlength_ms, ss);
+    attr.prebuf = ms2bytes (_prebuf_ms, ss);
+    attr.minreq = ms2bytes (_minreq_ms, ss);
+    attr.fragsize = (uint32_t)-1;
+    const pa_stream_flags_t flags = (_tlength_ms >= 0) ? PA_STREAM_ADJUST_LATENCY : PA_STREAM_NOFLAGS;
 
-    // call pa_simple_write
-    int rslt, err;
-    const char* name = nullptr;
     const char* dev = (_device.length () > 0) ? _device.c_str () : nullptr;
-    const pa_channel_map* map = nullptr;
-    const pa_buffer_attr* attr = nullptr;
-    pa_simple* s = pa_simple_new (_address.c_str(), name, PA_STREAM_PLAYBACK, dev, "playback", &ss, map, attr, &err);
-    if (!s)
+    if (pa_stream_connect_playback (_stream, dev, &attr, flags, nullptr, nullptr) < 0)
     {
-        syslog (LOG_ERR, "[consume] pa_simple_new (server=\"%s\") failed (%d)", _address.c_str(), err);
-        return (-1);
+        syslog (LOG_ERR, "[consume] pa_stream_connect_playback failed: %s", pa_strerror (pa_context_errno (_server->ctx)));
+        stream_close ();
+        return -1;
     }
-    assert (s);
-    while (1)
+
+    pa_stream_state_t state;
+    while ((state = pa_stream_get_state (_stream)) == PA_STREAM_CREATING || state == PA_STREAM_UNCONNECTED)
+        pa_threaded_mainloop_wait (_server->loop);
+    if (state != PA_STREAM_READY)
     {
-        const size_t max_len = 1024;
-        uint8_t buff[max_len];
-        ssize_t len = read (fd, buff, max_len);
-        if (len <= 0) break;
-        rslt = pa_simple_write (s, buff, len, &err);
-        if (rslt < 0) goto abort;
+        syslog (LOG_ERR, "[consume] stream failed: %s", pa_strerror (pa_context_errno (_server->ctx)));
+        stream_close ();
+        return -1;
     }
 
-    rslt = pa_simple_drain (s, &err);
-    if (rslt < 0) goto abort;
-    assert (rslt == 0);
+    _stream_fmt = fmt;
+    syslog (LOG_DEBUG, "[consume] stream opened (server=%s, rate=%d)", _address.c_str(), fmt.rate);
+    return 0;
+}
+
+// (with the mainloop locked)
+void
+sink_pulseaudio::stream_close ()
+{
+    if (!_stream) return;
+    pa_stream_set_state_callback (_stream, nullptr, nullptr);
+    pa_stream_set_write_callback (_stream, nullptr, nullptr);
+    if (pa_stream_get_state (_stream) == PA_STREAM_READY) pa_stream_disconnect (_stream);
+    pa_stream_unref (_stream);
+    _stream = nullptr;
+}
+
+// samples are written as soon as they arrive, as fast as the server requests them
+int
+sink_pulseaudio::consume (audio_stream::reader& in)
+{
+    syslog (LOG_DEBUG, "[play] address=%s device=\"%s\"", _address.c_str(), _device.c_str());
+
+    // WAV format
+    wav_format fmt;
+    if (in.format (fmt)) return (-1);
 
- abort:
-    if (rslt < 0) syslog (LOG_ERR, "[consume] abort on error: %d", err);
-    pa_simple_free (s);
+    pa_threaded_mainloop* loop = _server->loop;
+    pa_threaded_mainloop_lock (loop);
+    int err = stream_open (fmt);
+    if (!err && pa_stream_is_corked (_stream) > 0)
+        err = op_wait (loop, pa_stream_cork (_stream, 0, cb_stream_success, loop));
+    pa_threaded_mainloop_unlock (loop);
+    if (err) return (-1);
+
+    // the mainloop is not locked while waiting for the synthesizer
+    audio_ptr pcm;
+    int rslt = 0;
+    while (!err && (rslt = in.next (pcm)) > 0)
+    {
+        const uint8_t* p = pcm->data ();
+        size_t left = pcm->size ();
+
+        pa_threaded_mainloop_lock (loop);
+        while (left > 0)
+        {
+            if (pa_stream_get_state (_stream) != PA_STREAM_READY) { err = -1; break; }
+            size_t n = pa_stream_writable_size (_stream);
+            if (n == 0)
+            {
+                pa_threaded_mainloop_wait (loop);
+                continue;
+            }
+            if (n > left) n = left;
+            if (pa_stream_write (_stream, p, n, nullptr, 0, PA_SEEK_RELATIVE) < 0) { err = -1; break; }
+            p += n;
+            left -= n;
+        }
+        pa_threaded_mainloop_unlock (loop);
+    }
+
+    pa_threaded_mainloop_lock (loop);
+    if (err)
+    {
+        syslog (LOG_ERR, "[consume] abort on error: %s", pa_strerror (pa_context_errno (_server->ctx)));
+        stream_close ();
+    }
+    else if (rslt < 0)
+    {
+        // synthesis aborted -- what has been written is dropped
+        syslog (LOG_ERR, "[consume] stream aborted");
+        op_wait (loop, pa_stream_flush (_stream, cb_stream_success, loop));
+        err = -1;
+    }
+    else
+    {
+        // played through
+        err = op_wait (loop, pa_stream_drain (_stream, cb_stream_success, loop));
+        if (err) syslog (LOG_ERR, "[consume] drain failed");
+    }
+    // kept for the next utterance, but without underruns in between
+    if (_stream && _cork)
+        op_wait (loop, pa_stream_cork (_stream, 1, cb_stream_success, loop));
+    pa_threaded_mainloop_unlock (loop);
 
     return (err);
 }
@@ -4,21 +4,45 @@
 #define TTS_SINK_PULSEAUDIO_H
 
 #include "sink.h"
+#include <memory>
 #include <nlohmann/json.hpp>
 
+struct pa_stream;
+struct pulse_server;
+
 // pulseaudio sink
+// speech is played through a stream of a context (connection) to the server, both kept across utterances.
+// the context is shared by the sinks of the same server, and reconnected automatically when lost.
 class sink_pulseaudio final : public sink
 {
 public:
     sink_pulseaudio (const nlohmann::json& spec);
+    ~sink_pulseaudio ();
 
 public:
-    int consume (int fd) override;
+    using sink::consume;
+    int consume (audio_stream::reader& in) override;
+
+private:
+    // (with the mainloop locked)
+    int stream_open (const wav_format& fmt);
+    void stream_close ();
 
 private:
     std::string _address;	// ip addr
     //int _port;		// pulseaudio port
     std::string _device;	// pulseaudio device
+
+    std::shared_ptr<pulse_server> _server;
+    pa_stream* _stream;		// reused while the format is unchanged
+    wav_format _stream_fmt;
+    bool _cork;			// cork the stream between utterances
+
+    // pa_buffer_attr, in ms (-1 = server default)
+    int _maxlength_ms;
+    int _tlength_ms;		// target latency
+    int _prebuf_ms;
+    int _minreq_ms;
 };
 
 #endif
@@ -4,28 +4,23 @@
 #define TTS_SINK_SFTP_H
 
 #include "sink.h"
+#include "sftp_engine.h"
 #include <nlohmann/json.hpp>
 
 // sftp sink
+// uploads are carried out by sftp_engine (one thread for all the sftp sinks),
+// on authenticated sessions pooled per sink, kept alive while idle, and closed after idle_timeout.
 class sink_sftp final : public sink
 {
 public:
     sink_sftp (const nlohmann::json& spec);
 
 public:
-    int consume (int fd) override;
+    using sink::consume;
+    int consume (audio_stream::reader& in) override;
 
 private:
-    std::string _address;	// ip addr
-    int _port;			// tcp port (22)
-
-    // authentication info
-    std::string _username;
-    std::string _publickey_path;
-    std::string _privatekey_path;
-    std::string _password;
-
-    static bool _initialized;
+    sftp_target _target;	// host, authentication info, pool
 };
 
 #endif
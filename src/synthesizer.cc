@@ -4,26 +4,47 @@
 #include "logger.h"
 
 bool
-synthesizer::engine_compliant (const char* eng) const
+synthesizer::engine_compliant (const std::string& eng) const
 {
-    syslog (LOG_DEBUG, "[engine_compliant] engine=\"%s\"", eng ? eng : "");
+    syslog (LOG_DEBUG, "[engine_compliant] engine=\"%s\"", eng.c_str());
 
-    if (!eng) return true;
-    if (!strcmp (eng, "any")) return true;
-    if (!strncmp (eng, engine.c_str(), strlen (eng))) return true;
+    if (eng.empty ()) return true;
+    if (!eng.compare ("any")) return true;
+    if (!engine.compare (0, eng.length (), eng)) return true;
 
     return false;
 }
 
 bool
-synthesizer::language_supported (const char* lang) const
+synthesizer::language_supported (const std::string& lang) const
 {
-    syslog (LOG_DEBUG, "[language_supported] engine=%s language=%s", engine.c_str(), lang);
+    syslog (LOG_DEBUG, "[language_supported] engine=%s language=%s", engine.c_str(), lang.c_str());
 
     for (const std::string& l : languages)
     {
-        if (!strncmp (l.c_str(), lang, 2)) return true;
+        if (!l.compare (0, 2, lang, 0, 2)) return true;
     }
 
     return false;
 }
+
+int
+synthesizer::synthesize (const request& req, audio_stream& out)
+{
+    audio_ptr wav;
+    int err = synthesize (req, wav);
+    if (err)
+    {
+        out.close (-1);
+        return err;
+    }
+
+    return audio_stream::feed (out, wav);
+}
+
+void
+synthesizer::synthesize_async (const request& req, const audio_stream_ptr& out, done_t done)
+{
+    const int err = synthesize (req, *out);
+    if (done) done (err);
+}
@@ -4,25 +4,43 @@
 #define TTS_SYNTHESIZER_H
 
 #include <cstdint>
+#include <functional>
 #include <list>
 #include <nlohmann/json.hpp>
 
+#include "audio.h"
+#include "audio_stream.h"
+#include "request.h"
+
 // tts
 class synthesizer
 {
 public:
-    virtual int synthesize (const nlohmann::json& req, const char* outfile) = 0;
-    virtual int synthesize (const nlohmann::json& req, uint8_t*& bytes, size_t& len) = 0;
-    virtual bool synthesizable (const nlohmann::json& req) const = 0;
+    synthesizer () : concurrent (false) {}
+    virtual ~synthesizer () {}
+
+public:
+    // text -> wav (in memory)
+    virtual int synthesize (const request& req, audio_ptr& wav) = 0;
+    // text -> chunks of wav (out is closed in any case)
+    // by default, the whole wav is passed as a single chunk
+    virtual int synthesize (const request& req, audio_stream& out);
+    // text -> chunks of wav, without blocking the caller where the engine allows (e.g. rpcs)
+    // out is closed in any case, and then done is called with the result (possibly from another thread).
+    // by default, the synthesis runs in the caller
+    typedef std::function<void(int)> done_t;
+    virtual void synthesize_async (const request& req, const audio_stream_ptr& out, done_t done);
+    virtual bool synthesizable (const request& req) const = 0;
 
 public:
     std::string name;
     std::string engine;
     std::list<std::string> languages;
+    bool concurrent;	// whether synthesize may be called from several threads at once
 
 public:
-    bool engine_compliant (const char*) const;
-    bool language_supported (const char*) const;
+    bool engine_compliant (const std::string&) const;
+    bool language_supported (const std::string&) const;
 };
 
 #endif
@@ -2,6 +2,7 @@
 // note: a part of the code in this file reuses somebody else's which is licensed under GPL v3.
 
 #include "synth_espeak.h"
+#include "audio_stream.h"
 #include "logger.h"
 
 #include <nlohmann/json.hpp>
@@ -17,13 +18,20 @@
 #include <fstream>
 #include <iostream>
 #include <syslog.h>
-#include <thread>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <string>
 
 using json = nlohmann::json;
 
 //
 static int _init ();
-static int _synthesize (const nlohmann::json& req, const char* outfile);
+static int _synthesize (const request& req, audio_stream& out);
+
+// espeak-ng is not reentrant: one utterance at a time, whichever worker asks
+static std::mutex g_mutex;
 
 // ctor
 synth_espeak::synth_espeak (const nlohmann::json& spec)
@@ -41,44 +49,43 @@ synth_espeak::synth_espeak (const nlohmann::json& spec)
 
     //espeak_initialize (1, 2000000);
     //espeak_eval_command ("(gc)");
+    std::lock_guard<std::mutex> lock (g_mutex);
     _init ();
 }
 
 //
 int
-synth_espeak::synthesize (const nlohmann::json& req, uint8_t*& bytes, size_t& len)
+synth_espeak::synthesize (const request& req, audio_ptr& wav)
 {
-    assert (0);
-    return 0;
+    audio_stream out;
+    int err = synthesize (req, out);
+    if (err) return err;
+
+    wav = out.wav ();
+    return wav ? 0 : -1;
 }
 
+// chunks are passed to out as soon as espeak delivers them
 int
-synth_espeak::synthesize (const nlohmann::json& req, const char* outfile)
+synth_espeak::synthesize (const request& req, audio_stream& out)
 {
-    syslog (LOG_DEBUG, "[synthesize] %s", req.dump().c_str());
+    syslog (LOG_DEBUG, "[synthesize] text=\"%s\"", req.text.c_str());
 
-    int err = _synthesize (req, outfile);
+    std::lock_guard<std::mutex> lock (g_mutex);
+    int err = _synthesize (req, out);
 
     return err;
 }
 
 //
 bool
-synth_espeak::synthesizable (const nlohmann::json& req) const
+synth_espeak::synthesizable (const request& req) const
 {
-    syslog (LOG_DEBUG, "[synthesizable] %s", req.dump().c_str());
-
     // engine
-    if (req.find ("engine") != req.end ())
-    {
-        const std::string engine = req["engine"];
-        if (!engine_compliant (engine.c_str())) return false;
-    }
+    if (!engine_compliant (req.engine)) return false;
 
     // language
-    const std::string lang
-        = (req.find ("language") != req.end ()) ? req["language"] : "english";
-    if (!language_supported  (lang.c_str())) return false;
+    if (!language_supported (req.language)) return false;
 
     return true;
 }
@@ -93,71 +100,32 @@ synth_espeak::synthesizable (const nlohmann::json& req) const
 // license: GPL v3
 //
 
-static void
-Write4Bytes(FILE *f, int value)
-{
-	// Write 4 bytes to a file, least significant first
-	int ix;
-
-	for (ix = 0; ix < 4; ix++) {
-		fputc(value & 0xff, f);
-		value = value >> 8;
-	}
-}
-
-static FILE*
-OpenWavFile (const char *path, int rate)
-{
-    if (path == NULL) return nullptr;
-    //while (isspace(*path)) path++;
-
-    FILE* f_wavfile = fopen(path, "wb");
-    if (!f_wavfile)
-    {
-        syslog (LOG_ERR, "[OpenWavFile] failure in fopen(\"%s\")", path);
-        return nullptr;
-    }
-
-    static unsigned char wave_hdr[44] = {
-		'R', 'I', 'F', 'F', 0x24, 0xf0, 0xff, 0x7f, 'W', 'A', 'V', 'E', 'f', 'm', 't', ' ',
-		0x10, 0, 0, 0, 1, 0, 1, 0,  9, 0x3d, 0, 0, 0x12, 0x7a, 0, 0,
-		2, 0, 0x10, 0, 'd', 'a', 't', 'a',  0x00, 0xf0, 0xff, 0x7f
-    };
-
-    fwrite(wave_hdr, 1, 24, f_wavfile);
-    Write4Bytes(f_wavfile, rate);
-    Write4Bytes(f_wavfile, rate * 2);
-    fwrite(&wave_hdr[32], 1, 12, f_wavfile);
-
-    return f_wavfile;
-}
-
-static void
-CloseWavFile (FILE* f_wavfile)
+// the stream of the utterance being synthesized
+// ** espeak-ng is not reentrant; only one utterance at a time
+audio_stream* g_stream = nullptr;
+// what the engine is currently set up with (switched only when a request needs something else)
+// ** read and updated with g_mutex held, like the engine itself
+static struct
 {
-    if ((f_wavfile == NULL) || (f_wavfile == stdout))
-        return;
-
-    fflush(f_wavfile);
-
-    unsigned int pos = ftell(f_wavfile);
-
-    if (fseek(f_wavfile, 4, SEEK_SET) != -1)
-        Write4Bytes(f_wavfile, pos - 8);
-
-    if (fseek(f_wavfile, 40, SEEK_SET) != -1)
-        Write4Bytes(f_wavfile, pos - 44);
-
-    fclose(f_wavfile);
-}
-
-FILE* f_wavfile = nullptr;
+    bool output = false;	// espeak_ng_InitializeOutput & espeak_SetSynthCallback done
+    int samplerate = 0;
+    std::string voice;		// "" = none or unknown
+    int rate = -1, pitch = -1, volume = -1;
+} g_state;
+static bool g_terminated = false;	// end of the utterance (espeakEVENT_MSG_TERMINATED)
+static std::chrono::steady_clock::time_point g_deadline;	// synthesis is aborted past this
 
 static int
 SynthCallback(short *wav, int numsamples, espeak_EVENT *events)
 {
     syslog (LOG_DEBUG, "[SynthCallback] #sample=%d", numsamples);
 
+    for (espeak_EVENT* e = events; e && e->type != espeakEVENT_LIST_TERMINATED; e++)
+        if (e->type == espeakEVENT_MSG_TERMINATED) g_terminated = true;
+
+    // timed out -- non-zero aborts synthesis
+    if (std::chrono::steady_clock::now () > g_deadline) return 1;
+
     if (!wav) return 0;
 
     /*
@@ -187,12 +155,12 @@ SynthCallback(short *wav, int numsamples, espeak_EVENT *events)
       }
     */
 
-    // wav -> f_wavefile
+    // wav -> g_stream
     //samples_total += numsamples;
-    if (!f_wavfile) return 1;
+    if (!g_stream) return 1;
 
     if (numsamples > 0)
-        fwrite(wav, numsamples*2, 1, f_wavfile);
+        g_stream->write((const uint8_t*)wav, numsamples*2);
 
     return 0;
 }
@@ -212,112 +180,105 @@ _init (void)
         espeak_ng_ClearErrorContext(&context);
         return -1;
     }
+
+    // espeak_ng_InitializeOutput
+    // espeak_SetSynthCallback
+    result = espeak_ng_InitializeOutput(ENOUTPUT_MODE_SYNCHRONOUS, 0, NULL);
+    if (result != ENS_OK)
+    {
+        //espeak_ng_PrintStatusCodeMessage(result, stderr, NULL);
+        char error[512];
+        espeak_ng_GetStatusCodeMessage(result, error, sizeof(error));
+        syslog (LOG_ERR, "[espeak] error in espeak_ng_InitializeOutput (%d): %s", result, error);
+        return -1;
+    }
+    espeak_SetSynthCallback(SynthCallback);
+    g_state.samplerate = espeak_ng_GetSampleRate();
+    g_state.output = true;
+
     return 0;
 }
 
 
-// text -> wave
-// ** space for 'bytes' is allocated in this function, and needs to be deallocated by the caller
+// text -> wave (chunks into out, which gets closed in any case)
 // cf. https://github.com/espeak-ng/espeak-ng/blob/master/src/espeak-ng.c
 static int
-_synthesize (const json& req, const char* outfile)
+_synthesize (const request& req, audio_stream& out)
 {
-    //syslog (LOG_DEBUG, "[espeak] text=\"%s\"", text);
-
-    // req -> text
-    if (req.find("text") == req.end())
-    {
-        syslog (LOG_ERR, "[synthesize] no text found");
-        return -1;
-    }
-    const std::string text = req["text"];
+    const std::string& text = req.text;
 
     // lang/gender -> voicename
-    const char* lang = "en";
-    if (req.find("language") != req.end()) lang = req["language"].get<std::string>().substr(0, 2).c_str();
-    bool male = true;
-    if (req.find("gender") != req.end()) male = (tolower (*req["gender"].get<std::string>().c_str()) == 'm');
-    syslog (LOG_DEBUG, "[synthesize] text=\"%s\" language=%s gender=%s", text.c_str(), lang, (male ? "male" : "female"));
+    const std::string lang = req.lang2 ();
+    // male by default; of the genders given, only MALE is
+    const bool male = (req.gender == request::MALE || req.gender == request::UNSPECIFIED);
+    syslog (LOG_DEBUG, "[synthesize] text=\"%s\" language=%s gender=%s", text.c_str(), lang.c_str(), (male ? "male" : "female"));
     const char* voicename = nullptr;
-    if (!strcmp (lang, "en"))
+    if (!req.voice.empty ())
+        voicename = req.voice.c_str ();
+    else if (!lang.compare ("en"))
         voicename = male ? "gmw/en-US" : "mb/mb-us1";
-    else if (!strcmp (lang, "ja"))
+    else if (!lang.compare ("ja"))
         voicename = "jpx/ja";
     else
     {
-        syslog (LOG_ERR, "[synthesize] unknown language: %s", lang);
-        return -1;
-    }
-
-    // ----------------------------------------
-    // init
-    // ----------------------------------------
-
-    espeak_ng_STATUS result = ENS_OK;
-
-    /*
-    espeak_ng_InitializePath (nullptr);
-    espeak_ng_ERROR_CONTEXT context = NULL;
-    espeak_ng_STATUS result = espeak_ng_Initialize(&context);
-    if (result != ENS_OK)
-    {
-        //espeak_ng_PrintStatusCodeMessage(result, stderr, context);
-        char error[512];
-        espeak_ng_GetStatusCodeMessage(result, error, sizeof(error));
-        syslog (LOG_DEBUG, "[espeak] error in espeak_ng_Initialize (%d): %s", result, error);
-        espeak_ng_ClearErrorContext(&context);
+        syslog (LOG_ERR, "[synthesize] unknown language: %s", lang.c_str());
+        out.close (-1);
         return -1;
     }
-    */
 
     // ----------------------------------------
     // setups
     // ----------------------------------------
 
-    // espeak_ng_InitializeOutput
-    // espeak_SetSynthCallback
-    result = espeak_ng_InitializeOutput(ENOUTPUT_MODE_SYNCHRONOUS, 0, NULL);
-
-    int samplerate = espeak_ng_GetSampleRate();
-    f_wavfile = OpenWavFile (outfile, samplerate);
-    espeak_SetSynthCallback(SynthCallback);
-
-    if (result != ENS_OK)
+    // output & callback: once (cf. _init)
+    if (!g_state.output)
     {
-        //espeak_ng_PrintStatusCodeMessage(result, stderr, NULL);
-        char error[512];
-        espeak_ng_GetStatusCodeMessage(result, error, sizeof(error));
-        syslog (LOG_DEBUG, "[espeak] error in espeak_SetSynthCallback (%d): %s", result, error);
-        //exit(EXIT_FAILURE);
+        syslog (LOG_ERR, "[espeak] output not initialized");
+        out.close (-1);
         return -1;
     }
+    out.open (wav_format { g_state.samplerate, 1, 16 });
+    g_stream = &out;
 
     // espeak_ng_SetVoiceByName
+    // only when the voice changes (loading a voice reads its dictionary and phoneme data)
     if (!voicename) voicename = ESPEAKNG_DEFAULT_VOICE;	// ESPEAKNG_DEFAULT_VOICE = "en"
-    result = espeak_ng_SetVoiceByName(voicename);
-
-    if (result != ENS_OK)
+    if (g_state.voice != voicename)
     {
-        char error[512];
-        espeak_ng_GetStatusCodeMessage(result, error, sizeof(error));
-        syslog (LOG_ERR, "[espeak] error in espeak_SetVoiceByName (err=%d, voice=\"%s\"): %s", result, voicename, error);
-
-        // fallback
-        espeak_VOICE voice_select;
-        memset(&voice_select, 0, sizeof(voice_select));
-        voice_select.languages = voicename;
-        result = espeak_ng_SetVoiceByProperties(&voice_select);
-        if (result != ENS_OK) {
-            //espeak_ng_PrintStatusCodeMessage(result, stderr, NULL);
-            //exit(EXIT_FAILURE);
-            return -1;
+        g_state.voice.clear ();
+        g_state.rate = g_state.pitch = g_state.volume = -1;	// reset by a voice change
+        espeak_ng_STATUS result = espeak_ng_SetVoiceByName(voicename);
+
+        if (result != ENS_OK)
+        {
+            char error[512];
+            espeak_ng_GetStatusCodeMessage(result, error, sizeof(error));
+            syslog (LOG_ERR, "[espeak] error in espeak_SetVoiceByName (err=%d, voice=\"%s\"): %s", result, voicename, error);
+
+            // fallback
+            espeak_VOICE voice_select;
+            memset(&voice_select, 0, sizeof(voice_select));
+            voice_select.languages = voicename;
+            result = espeak_ng_SetVoiceByProperties(&voice_select);
+            if (result != ENS_OK) {
+                //espeak_ng_PrintStatusCodeMessage(result, stderr, NULL);
+                //exit(EXIT_FAILURE);
+                out.close (-1);
+                g_stream = nullptr;
+                return -1;
+            }
         }
+        g_state.voice = voicename;
+        syslog (LOG_DEBUG, "[espeak] voice: %s", voicename);
     }
 
-    //
-    espeak_SetParameter (espeakRATE, 130, 0);			// default:175
-    //espeak_SetParameter (espeakVOLUME, volume, 0);
-    espeak_SetParameter(espeakPITCH, 50, 0);			// default:50
+    // parameters: only those that differ from the current ones
+    const int rate = (req.rate > 0) ? std::min (std::max (req.rate, 80), 450) : 130;	// espeak default:175
+    const int pitch = (req.pitch >= 0) ? req.pitch : 50;	// default:50
+    const int volume = (req.volume >= 0) ? std::min (req.volume, 200) : 100;	// default:100
+    if (g_state.rate != rate && espeak_SetParameter (espeakRATE, rate, 0) == EE_OK) g_state.rate = rate;
+    if (g_state.pitch != pitch && espeak_SetParameter (espeakPITCH, pitch, 0) == EE_OK) g_state.pitch = pitch;
+    if (g_state.volume != volume && espeak_SetParameter (espeakVOLUME, volume, 0) == EE_OK) g_state.volume = volume;
     //espeak_SetParameter(espeakCAPITALS, option_capitals, 0);
     //espeak_SetParameter(espeakPUNCTUATION, option_punctuation, 0);
     //espeak_SetParameter(espeakWORDGAP, wordgap, 0);
@@ -330,27 +291,21 @@ _synthesize (const json& req, const char* outfile)
 
     // espeak_Synth
     // espeak_ng_Synchronize
+    // in the synchronous mode, espeak_Synth returns once the whole utterance has gone through SynthCallback
+    // (no polling of espeak_IsPlaying); the end is marked by espeakEVENT_MSG_TERMINATED
     int synth_flags = espeakCHARS_AUTO | espeakPHONEMES | espeakENDPAUSE;
     const char* str = text.c_str();
     int size = strlen (str);
-    espeak_Synth (str, size+1, 0, POS_CHARACTER, 0, synth_flags, NULL, NULL);
-
-    //result = espeak_ng_Synchronize();
-    result = ENS_OK;
-    int count = 0;
-    while (espeak_IsPlaying ())
+    g_terminated = false;
+    g_deadline = std::chrono::steady_clock::now () + std::chrono::seconds (5);
+    espeak_ERROR rc = espeak_Synth (str, size+1, 0, POS_CHARACTER, 0, synth_flags, NULL, NULL);
+    espeak_ng_STATUS result = espeak_ng_Synchronize();
+    if (rc != EE_OK || !g_terminated)
     {
-        std::this_thread::sleep_for (std::chrono::milliseconds (100));
-        if (++count == 50)
-        {
-            // timed out
-            result = espeak_ng_Cancel ();
-
-            syslog (LOG_DEBUG, "[espeak] canceled (%d)", result);
-            //result = espeak_ng_Synchronize();
-            CloseWavFile (f_wavfile);
-            return -1;
-        }
+        syslog (LOG_ERR, "[espeak] synthesis incomplete (err=%d%s)", rc, g_terminated ? "" : ", canceled or timed out");
+        out.close (-1);
+        g_stream = nullptr;
+        return -1;
     }
 
     if (result != ENS_OK)
@@ -361,6 +316,8 @@ _synthesize (const json& req, const char* outfile)
 
         //espeak_ng_PrintStatusCodeMessage(result, stderr, NULL);
         //exit(EXIT_FAILURE);
+        out.close (-1);
+        g_stream = nullptr;
         return -1;
     }
 
@@ -368,7 +325,8 @@ _synthesize (const json& req, const char* outfile)
     // cleanup
     // ----------------------------------------
 
-    CloseWavFile (f_wavfile);
+    out.close ();
+    g_stream = nullptr;
     //espeak_ng_Terminate();
 
     return 0;
@@ -15,9 +15,9 @@ public:
     synth_espeak (const nlohmann::json& spec);
 
 public:
-    int synthesize (const nlohmann::json& req, const char* outfile) override;
-    int synthesize (const nlohmann::json& req, uint8_t*& bytes, size_t& len) override;
-    bool synthesizable (const nlohmann::json& req) const override;
+    int synthesize (const request& req, audio_ptr& wav) override;
+    int synthesize (const request& req, audio_stream& out) override;
+    bool synthesizable (const request& req) const override;
 };
 
 #endif
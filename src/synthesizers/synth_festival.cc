@@ -3,17 +3,23 @@
 
 #include <festival/festival.h>
 #include "synth_festival.h"
+#include "synth_pool.h"
 #include "logger.h"
 
-#include <fstream>
-#include <iostream>
 #include <cassert>
 #include <cstdlib>
-#include <cstdio>
+#include <cstring>
 #include <syslog.h>
-#include <ctime>
+#include <vector>
+
+// [ref]
+// - http://www.cstr.ed.ac.uk/projects/festival/manual/festival_28.html
+// - http://www.festvox.org/docs/manual-2.4.0/festival_34.html
+// - https://www.cstr.ed.ac.uk/projects/festival/manual/festival_8.html#SEC23 -- scheme
+static bool g_initialized = false;
 
 synth_festival::synth_festival (const nlohmann::json& spec)
+    : _heap (2000000), _running (false), _ready (false)
 {
     if (spec.find("name") != spec.end())
         name = spec["name"];
@@ -26,143 +32,170 @@ synth_festival::synth_festival (const nlohmann::json& spec)
     languages.push_back ("es");
     languages.push_back ("fr");
 
-    //festival_initialize (1, 2000000);
-    //festival_eval_command ("(gc)");
+    // voices: language -> festival voice (e.g. {"en": "kal_diphone", "es": "el_diphone"})
+    if (spec.find ("voices") != spec.end () && spec["voices"].is_object ())
+        for (nlohmann::json::const_iterator it = spec["voices"].begin (); it != spec["voices"].end (); ++it)
+            if (it.value().is_string ()) _voices[it.key().substr (0, 2)] = it.value();
+
+    if (spec.find ("heap") != spec.end () && spec["heap"].is_number_unsigned ())
+        _heap = spec["heap"];
+
+    // when pooled, not before fork (see synth_pool)
+    if (!synth_pool::pooled (spec)) start ();
 }
 
-// str -> bytes
-// ** space for 'bytes' is allocated in this function, and needs to be deallocated by the caller
-static int
-_synthesize (const char* str, uint8_t*& bytes, size_t& length)
+int
+synth_festival::start ()
 {
-    syslog (LOG_DEBUG, "[festival] text=\"%s\"", str);
+    std::unique_lock<std::mutex> lock (_mutex);
+    if (!_running)
+    {
+        std::thread (&synth_festival::thread_engine, this).detach ();
+        _running = true;
+    }
+    _cv.wait (lock, [this]() { return _ready; });
+    return g_initialized ? 0 : -1;
+}
 
-    length = 0;
-    bytes = nullptr;
+// once per process, on the engine thread
+void
+synth_festival::initialize ()
+{
+    assert (!g_initialized);  // a single instance (see synth_add)
+    festival_initialize (1, _heap);
+    g_initialized = true;
 
-    // synthesis using festival
-    // [ref]
-    // - http://www.cstr.ed.ac.uk/projects/festival/manual/festival_28.html
-    // - http://www.festvox.org/docs/manual-2.4.0/festival_34.html
-    // - https://www.cstr.ed.ac.uk/projects/festival/manual/festival_8.html#SEC23 -- scheme
-    festival_initialize (1, 2000000);
+    // preload voices (loading on the first request would delay it)
+    for (const std::pair<const std::string, std::string>& v : _voices)
+    {
+        const std::string cmd = "(voice_" + v.second + ")";
+        if (!festival_eval_command (cmd.c_str ()))
+            syslog (LOG_ERR, "[festival] voice not loaded: %s", v.second.c_str());
+        else
+            _voice = v.second;
+    }
     festival_eval_command ("(gc)");
+    syslog (LOG_INFO, "[festival] %s: initialized (%d voice(s))", name.c_str(), (int)_voices.size ());
+}
 
-    // text -> wave
-    const EST_String text (str);
-    EST_Wave wave;  // [ref] http://festvox.org/docs/speech_tools-2.4.0/classEST__Wave.html
-    int ok = festival_text_to_wave (text, wave);
-    if (!ok)
+// the engine thread -- every festival call is made here, from the initialization on
+void
+synth_festival::thread_engine ()
+{
+    initialize ();
     {
-        syslog (LOG_ERR, "[festival] failure in text->wave (%d)", ok);
-        return -1;
+        std::unique_lock<std::mutex> lock (_mutex);
+        _ready = true;
     }
-    festival_wait_for_spooler ();
+    _cv.notify_all ();
 
-    // wave -> bytes
-    const int nsample = wave.num_samples ();
-    const int size = nsample * 2 + 44; // wave header: 44bytes
-    bytes = (uint8_t*)malloc (size);
-    FILE* out = fmemopen (bytes, size, "w");
-    EST_write_status status = wave.save (out, "riff");
-    length = ftell (out);
-    assert (length > 0);
-    fclose (out);
-
-    syslog (LOG_INFO,
-            "[festival] wave: "
-            "(nsample=%d, nchan=%d, rate=%d, type=%s, "
-            "len=%d, result=%d)\n",
-            wave.num_samples (), wave.num_channels (), wave.sample_rate (), wave.sample_type ().str (),
-            length, (int)status);
-
-    if (status != write_ok)
+    while (1)
     {
-        syslog (LOG_ERR, "failure in wave->bytes (%d)", (int)status);
-        return -1;
+        job* j = nullptr;
+        {
+            std::unique_lock<std::mutex> lock (_mutex);
+            _cv.wait (lock, [this]() { return !_jobs.empty (); });
+            j = _jobs.front ();
+            _jobs.pop_front ();
+        }
+
+        const int err = run (*j);
+
+        {
+            std::unique_lock<std::mutex> lock (_mutex);
+            j->err = err;
+            j->done = true;
+        }
+        _cv.notify_all ();
     }
-    //std::cerr << "  size:\t\t" << len << "\n";
-
-    // response
-    //response->set_audio_content (bytes, len);
-    return 0;
 }
 
-//
+// text -> EST_Wave -> wav (samples copied straight into the buffer, after the header)
 int
-synth_festival::synthesize (const nlohmann::json& req, uint8_t*& bytes, size_t& len)
+synth_festival::run (job& j)
 {
-    syslog (LOG_DEBUG, "[synthesize] %s", req.dump().c_str());
+    const request& req = *j.req;
+    syslog (LOG_DEBUG, "[festival] text=\"%s\"", req.text.c_str());
 
-    // req -> text
-    if (req.find("text") == req.end())
+    // voice of the language (switched only when it differs)
+    std::map<std::string, std::string>::const_iterator v = _voices.find (req.lang2 ());
+    if (v != _voices.end () && v->second != _voice)
     {
-        syslog (LOG_ERR, "no text found");
+        const std::string cmd = "(voice_" + v->second + ")";
+        if (!festival_eval_command (cmd.c_str ()))
+        {
+            syslog (LOG_ERR, "[festival] voice not selected: %s", v->second.c_str());
+            return -1;
+        }
+        _voice = v->second;
+    }
+
+    // text -> wave
+    const EST_String text (req.text.c_str ());
+    EST_Wave wave;  // [ref] http://festvox.org/docs/speech_tools-2.4.0/classEST__Wave.html
+    int ok = festival_text_to_wave (text, wave);
+    if (!ok)
+    {
+        syslog (LOG_ERR, "[festival] failure in text->wave (%d)", ok);
         return -1;
     }
-    const std::string text = req["text"];
-    const std::string lang = (req.find("language") != req.end()) ? (req["language"]) : "english";
-
-    // text -> bytes
-    //uint8_t* bytes = nullptr;
-    //int len = 0;
-    int err = _synthesize (text.c_str(), bytes, len);
-    if (err) return err; // something went wrong
-    syslog (LOG_DEBUG, "[synthesize] len=%d", len);
-    if (len == 0) return -1;
-    if (!bytes)
+
+    const int nsample = wave.num_samples ();
+    const int nchan = wave.num_channels ();
+    syslog (LOG_INFO, "[festival] wave: (nsample=%d, nchan=%d, rate=%d)", nsample, nchan, wave.sample_rate ());
+    if (nsample <= 0 || nchan <= 0)
     {
-        syslog (LOG_ERR, "[synthesize] no audio data generated");
+        syslog (LOG_ERR, "[festival] no audio data generated");
         return -1;
     }
 
+    // wave -> header + 16-bit samples (interleaved)
+    const size_t datalen = (size_t)nsample * nchan * 2;
+    std::vector<uint8_t> bytes (WAV_HEADER_SIZE + datalen);
+    wav_header (bytes.data (), wav_format { wave.sample_rate (), nchan, 16 }, datalen);
+    short* pcm = (short*)(bytes.data () + WAV_HEADER_SIZE);
+    if (nchan == 1)
+        wave.copy_channel (0, pcm);
+    else
+        for (int i = 0; i < nsample; i++)
+            wave.copy_sample (i, pcm + (size_t)i * nchan);
+
+    j.wav = std::make_shared<audio> (std::move (bytes));
     return 0;
 }
 
+//
 int
-synth_festival::synthesize (const nlohmann::json& req, const char* outfile)
+synth_festival::synthesize (const request& req, audio_ptr& wav)
 {
-    syslog (LOG_DEBUG, "[synthesize] %s", req.dump().c_str());
-
-    // req -> bytes
-    //syslog (LOG_DEBUG, "[synthesize] write %dB", length);
-    uint8_t* bytes = nullptr;
-    size_t len = 0;
-    int err = synthesize (req, bytes, len);
-    if (err)
+    syslog (LOG_DEBUG, "[synthesize] text=\"%s\"", req.text.c_str());
+    // (when pooled, the first request of the worker process waits for the initialization)
+    if (start ()) return -1;
+
+    job j = { &req, nullptr, -1, false };
     {
-        syslog (LOG_ERR, "[synth_festival::synthesize] synthesis failed");
-        if (bytes) delete bytes;
-        return err;
+        std::unique_lock<std::mutex> lock (_mutex);
+        _jobs.push_back (&j);
     }
+    _cv.notify_all ();
 
-    // bytes -> outfile
-    std::ofstream out (outfile, std::ios::out | std::ios::binary);
-    out.write ((const char*)bytes, len);
-    out.close ();
+    std::unique_lock<std::mutex> lock (_mutex);
+    _cv.wait (lock, [&j]() { return j.done; });
+    if (j.err) return j.err;
 
-    delete bytes;
-
-    return (err);
+    wav = j.wav;
+    return 0;
 }
 
 //
 bool
-synth_festival::synthesizable (const nlohmann::json& req) const
+synth_festival::synthesizable (const request& req) const
 {
-    syslog (LOG_DEBUG, "[synthesizable] %s", req.dump().c_str());
-
     // engine
-    if (req.find ("engine") != req.end ())
-    {
-        const std::string engine = req["engine"];
-        if (!engine_compliant (engine.c_str())) return false;
-    }
+    if (!engine_compliant (req.engine)) return false;
 
     // language
-    const std::string lang
-        = (req.find ("language") != req.end ()) ? req["language"] : "english";
-    if (!language_supported  (lang.c_str())) return false;
+    if (!language_supported (req.language)) return false;
 
     return true;
 }
@@ -3,21 +3,57 @@
 #ifndef SYNTH_FESTIVAL_H
 #define SYNTH_FESTIVAL_H
 
+#include <condition_variable>
+#include <deque>
 #include <list>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <nlohmann/json.hpp>
 
 #include "synthesizer.h"
 
-//
+// festival is driven by a resident engine thread, which initializes it (with the voices of the
+// configured languages preloaded), then serves the requests one at a time: every festival call is
+// made on that thread (the garbage collector of its scheme interpreter scans the stack it was initialized on).
+// the constructor waits for the initialization; when pooled, each worker process initializes its own
+// upon its first request instead (a thread does not survive fork).
+// ** festival is process-global: a single instance per process
 class synth_festival: public synthesizer
 {
 public:
+    // spec = {.., voices:{<language>: <voice>, ..}, heap}
     synth_festival (const nlohmann::json& spec);
 
 public:
-    int synthesize (const nlohmann::json& req, const char* outfile) override;
-    int synthesize (const nlohmann::json& req, uint8_t*& bytes, size_t& len) override;
-    bool synthesizable (const nlohmann::json& req) const override;
+    int synthesize (const request& req, audio_ptr& wav) override;
+    bool synthesizable (const request& req) const override;
+
+private:
+    struct job
+    {
+        const request* req;
+        audio_ptr wav;
+        int err;
+        bool done;
+    };
+
+    int start ();	// engine thread, once initialized (-1: initialization failed)
+    void thread_engine ();
+    void initialize ();
+    int run (job& j);
+
+private:
+    std::map<std::string, std::string> _voices;	// language prefix -> festival voice
+    std::string _voice;				// currently selected
+    int _heap;
+
+    std::deque<job*> _jobs;
+    std::mutex _mutex;
+    std::condition_variable _cv;	// a job enqueued or done, or festival initialized
+    bool _running;	// the engine thread is started
+    bool _ready;	// festival initialized (or failed to)
 };
 
 #endif
@@ -3,15 +3,19 @@
 #include "synth_gcloud.h"
 #include "logger.h"
 
+#include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctype.h>
 #include <fstream>
+#include <thread>
 
 // grpc
 #include <grpc++/grpc++.h>
+#include <grpcpp/alarm.h>
 using grpc::Channel;
 using grpc::ClientContext;
 using grpc::Status;
@@ -66,8 +70,21 @@ using google::cloud::texttospeech::v1beta1::TextToSpeech;
 #define PREFIX "/usr/local"
 #endif
 
+// conf has key, of the given type (a value of another type is logged, and ignored)
+static bool
+setting (const nlohmann::json& conf, const char* key, nlohmann::json::value_t type, const char* prefix = "")
+{
+    nlohmann::json::const_iterator it = conf.find (key);
+    if (it == conf.end ()) return false;
+    if (it->type () == type) return true;
+    syslog (LOG_ERR, "[synth_gcloud] invalid %s%s: %s (ignored)", prefix, key, it->dump().c_str());
+    return false;
+}
+
 // ctor
 synth_gcloud::synth_gcloud (const nlohmann::json& spec)
+    : _deadline (10000), _max_jobs (64), _jobs (0), _hedging (true), _hedge_min (50), _eject_failures (3), _eject_duration (10), _tags (0),
+      _completed (0), _failed (0), _deadline_exceeded (0), _hedged (0), _hedge_wins (0), _failovers (0), _throttled (0)
 {
     syslog (LOG_DEBUG, "[synth_gcloud] %s", spec.dump().c_str());
 
@@ -81,7 +98,7 @@ synth_gcloud::synth_gcloud (const nlohmann::json& spec)
     assert (spec.find ("languages") != spec.end ());
     assert (spec["languages"].is_array ());
     const std::vector<std::string> langs = spec["languages"];
-    for (const std::string lang : langs) languages.push_back (lang);
+    for (const std::string& lang : langs) languages.push_back (lang);
 
     // name
     if (spec.find("name") != spec.end())
@@ -89,6 +106,13 @@ synth_gcloud::synth_gcloud (const nlohmann::json& spec)
     else
         name = engine;
 
+    // rpcs are independent of each other
+    concurrent = true;
+
+    // deadline of each rpc
+    if (setting (spec, "deadline_ms", nlohmann::json::value_t::number_unsigned))
+        _deadline = std::chrono::milliseconds (spec["deadline_ms"].get<unsigned>());
+
     // api
     assert (spec.find ("api") != spec.end ());
     const nlohmann::json api = spec["api"];
@@ -99,17 +123,43 @@ synth_gcloud::synth_gcloud (const nlohmann::json& spec)
         return;
     }
 
-    // host & port
-    assert (spec.find ("host") != spec.end ());
-    const nlohmann::json host = spec["host"];
-    assert (host.is_string ());
-    _host = host.get<std::string>();
-    syslog (LOG_DEBUG, "[synth_gcloud] host=%s", _host.c_str());
-    size_t pos = _host.find (':');
-    if (pos != std::string::npos)
+    // bound on the requests in flight
+    if (setting (spec, "max_inflight", nlohmann::json::value_t::number_unsigned))
+        _max_jobs = std::max (spec["max_inflight"].get<int>(), 1);
+
+    // hedging
+    if (spec.find ("hedge") != spec.end () && spec["hedge"].is_object ())
+    {
+        const nlohmann::json& hedge = spec["hedge"];
+        if (setting (hedge, "enabled", nlohmann::json::value_t::boolean, "hedge."))
+            _hedging = hedge["enabled"];
+        if (setting (hedge, "min_ms", nlohmann::json::value_t::number_unsigned, "hedge."))
+            _hedge_min = std::chrono::milliseconds (hedge["min_ms"].get<unsigned>());
+    }
+
+    // ejection
+    if (spec.find ("eject") != spec.end () && spec["eject"].is_object ())
     {
-        _port = _host.substr (pos + 1);
-        _host = _host.substr (0, pos);
+        const nlohmann::json& eject = spec["eject"];
+        if (setting (eject, "failures", nlohmann::json::value_t::number_unsigned, "eject."))
+            _eject_failures = std::max (eject["failures"].get<int>(), 1);
+        if (setting (eject, "duration_s", nlohmann::json::value_t::number_unsigned, "eject."))
+            _eject_duration = std::chrono::seconds (eject["duration_s"].get<unsigned>());
+    }
+
+    // hosts (host:port)
+    std::vector<std::string> hosts;
+    if (spec.find ("hosts") != spec.end () && spec["hosts"].is_array ())
+    {
+        for (const nlohmann::json& h : spec["hosts"])
+            if (h.is_string ()) hosts.push_back (h);
+    }
+    else if (spec.find ("host") != spec.end () && spec["host"].is_string ())
+        hosts.push_back (spec["host"]);
+    if (hosts.empty ())
+    {
+        syslog (LOG_ERR, "[synth_gcloud] no host specified");
+        return;
     }
 
     // credentials
@@ -158,206 +208,531 @@ synth_gcloud::synth_gcloud (const nlohmann::json& spec)
     }
     syslog (LOG_DEBUG, "[synth_gcloud] credentials created");
 
-    // channel
-    std::shared_ptr<grpc::Channel> channel = grpc::CreateChannel(host, creds);
-    if (!channel)
+    // channel pool (per endpoint)
+    // channels = {count, keepalive_s, warmup}
+    int nchannel = 1;
+    int keepalive_s = 30;
+    bool warmup = true;
+    if (spec.find ("channels") != spec.end () && spec["channels"].is_object ())
     {
-        syslog (LOG_DEBUG, "[synth_gcloud] channel creation failure");
-        return;
+        const nlohmann::json& channels = spec["channels"];
+        if (setting (channels, "count", nlohmann::json::value_t::number_unsigned, "channels."))
+            nchannel = std::max (channels["count"].get<int>(), 1);
+        if (setting (channels, "keepalive_s", nlohmann::json::value_t::number_unsigned, "channels."))
+        {
+            if (channels["keepalive_s"].get<unsigned>() <= INT_MAX / 1000)
+                keepalive_s = channels["keepalive_s"];
+            else
+                syslog (LOG_ERR, "[synth_gcloud] invalid channels.keepalive_s: %s (ignored)", channels["keepalive_s"].dump().c_str());
+        }
+        if (setting (channels, "warmup", nlohmann::json::value_t::boolean, "channels."))
+            warmup = channels["warmup"];
     }
-    syslog (LOG_DEBUG, "[synth_gcloud] channel created: host=%s", host.dump().c_str());
 
-    // stub
-    _stub = TextToSpeech::NewStub (channel);
-    if (!_stub)
+    // each channel gets a connection of its own (no subchannel sharing), kept alive while idle
+    grpc::ChannelArguments args;
+    args.SetInt (GRPC_ARG_USE_LOCAL_SUBCHANNEL_POOL, 1);
+    args.SetInt (GRPC_ARG_CLIENT_IDLE_TIMEOUT_MS, INT_MAX);
+    if (keepalive_s > 0)
     {
-        syslog (LOG_ERR, "[synth_gcloud] stub creation failure");
-        return;
+        args.SetInt (GRPC_ARG_KEEPALIVE_TIME_MS, keepalive_s * 1000);
+        args.SetInt (GRPC_ARG_KEEPALIVE_TIMEOUT_MS, 10000);
+        args.SetInt (GRPC_ARG_KEEPALIVE_PERMIT_WITHOUT_CALLS, 1);
+        args.SetInt (GRPC_ARG_HTTP2_MAX_PINGS_WITHOUT_DATA, 0);
     }
-    syslog (LOG_DEBUG, "[synth_gcloud] stub created");
 
+    // endpoints: channels & stubs
+    _endpoints.resize (hosts.size ());
+    for (size_t i = 0; i < hosts.size (); i++)
+    {
+        endpoint& ep = _endpoints[i];
+        ep.host = hosts[i];
+        ep.rr = 0;
+        ep.outstanding = 0;
+        ep.next = 0;
+        ep.failures = 0;
+        ep.requests = ep.errors = ep.ejections = 0;
+
+        for (int k = 0; k < nchannel; k++)
+        {
+            std::shared_ptr<grpc::Channel> channel = grpc::CreateCustomChannel (ep.host, creds, args);
+            if (!channel)
+            {
+                syslog (LOG_ERR, "[synth_gcloud] channel creation failure: host=%s", ep.host.c_str());
+                continue;
+            }
+            std::unique_ptr<TextToSpeech::Stub> stub = TextToSpeech::NewStub (channel);
+            if (!stub)
+            {
+                syslog (LOG_ERR, "[synth_gcloud] stub creation failure: host=%s", ep.host.c_str());
+                continue;
+            }
+
+            // warm-up: name resolution and connection (tcp, tls, http/2) are started right away,
+            // in the background, rather than upon the first request
+            if (warmup) channel->GetState (true);
+
+            ep.channels.push_back (channel);
+            ep.stubs.push_back (std::move (stub));
+        }
+        syslog (LOG_DEBUG, "[synth_gcloud] %d channel(s) created: host=%s", (int)ep.stubs.size (), ep.host.c_str());
+    }
 }
 
-// req = {text, language, gender, engine, sinks:[..]}
+// req = {text, language, gender, engine, host, ..}
 bool
-synth_gcloud::synthesizable (const nlohmann::json& req) const
+synth_gcloud::synthesizable (const request& req) const
 {
-    syslog (LOG_DEBUG, "[synthesizable] %s", req.dump().c_str());
-
-    // (unique) name
-    std::string name_;
-    if (req.find("name") != req.end()) name_ = req["name"];
-    if (!name_.empty() && name_.compare(name)) return false;
-
-    // host
-    if (req.find ("host") != req.end ())
+    // host (any of the endpoints)
+    if (!req.host.empty ())
     {
-        std::string host = req["host"];
-        if (strncmp (host.c_str(), _host.c_str(), _host.length ())) return false;
-        size_t pos = host.find (':');
-        if (pos != std::string::npos && host.substr(pos + 1).compare(_port) != 0) return false;
+        const std::string& host = req.host;
+        const size_t pos = host.find (':');
+        bool found = false;
+        for (const endpoint& ep : _endpoints)
+        {
+            const size_t epos = ep.host.find (':');
+            const std::string h = ep.host.substr (0, epos);
+            const std::string port = (epos != std::string::npos) ? ep.host.substr (epos + 1) : "";
+            if (strncmp (host.c_str(), h.c_str(), h.length ())) continue;
+            if (pos != std::string::npos && host.substr(pos + 1).compare(port) != 0) continue;
+            found = true;
+            break;
+        }
+        if (!found) return false;
     }
 
     // engine
-    if (req.find ("engine") != req.end ())
-    {
-        const std::string engine = req["engine"];
-        if (!engine_compliant (engine.c_str())) return false;
-    }
+    if (!engine_compliant (req.engine)) return false;
 
     // language
-    const std::string lang
-        = (req.find ("language") != req.end ()) ? req["language"] : "en-US";
-    if (!language_supported  (lang.c_str())) return false;
+    if (!language_supported (req.language)) return false;
 
     return true;
 }
 
-int
-synth_gcloud::synthesize (const nlohmann::json& req, const char* outfile)
-{
-    uint8_t* bytes;
-    size_t len;
-    int err = synthesize (req, bytes, len);
-    if (err) return err;
+// --------------------------------------------------------------------------------
+// rpcs
+// --------------------------------------------------------------------------------
 
-    std::ofstream out (outfile, std::ios::out | std::ios::binary);
-    out.write ((const char*)bytes, len);
-    delete bytes;
-    out.close ();
+// what is pending on the completion queue
+struct synth_gcloud::tag
+{
+    synth_gcloud* synth;
+    virtual ~tag () {}
+    virtual void proceed (bool ok) = 0;
+};
 
-    return 0;
-}
+// a request, which may be sent to several endpoints (hedging, failover)
+struct synth_gcloud::job
+{
+    SynthesizeSpeechRequest request;
+    std::chrono::system_clock::time_point deadline;
+    reply_t reply;
+    bool replied;
+    std::vector<call*> calls;		// in flight
+    std::vector<endpoint*> tried;
+    timer* hedge;			// pending hedging timer
+};
+
+// an rpc in flight
+struct synth_gcloud::call : tag
+{
+    job_ptr j;
+    endpoint* ep;
+    bool hedged;
+    std::chrono::steady_clock::time_point t0;
+    ClientContext context;
+    SynthesizeSpeechResponse resp;
+    Status status;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<SynthesizeSpeechResponse>> reader;
 
+    void proceed (bool ok) override { synth->complete (this, ok); }
+};
 
-// 'bytes' are newly allocated in this function
-int
-synth_gcloud::synthesize (const nlohmann::json& req, uint8_t*& bytes, size_t& len)
+// hedging timer (ok = false when canceled)
+struct synth_gcloud::timer : tag
 {
-    syslog (LOG_DEBUG, "[synthesize] %s", req.dump().c_str());
+    job_ptr j;
+    grpc::Alarm alarm;
+
+    void proceed (bool) override { synth->hedge (this); }
+};
 
-    if (!_stub)
+// shared by all the instances; created (along with the poller thread) upon the first rpc
+static grpc::CompletionQueue* g_cq = nullptr;
+static std::once_flag g_cq_once;
+
+// completions -> tag::proceed
+void
+synth_gcloud::thread_poll ()
+{
+    void* p = nullptr;
+    bool ok = false;
+    while (g_cq->Next (&p, &ok))
     {
-        syslog (LOG_ERR, "[synthesize] no stub attached");
-        return -1;
+        tag* t = static_cast<tag*> (p);
+        synth_gcloud* synth = t->synth;
+        t->proceed (ok);
+        delete t;
+        synth->release ();
     }
+}
 
-    // input: text, ssml
-    std::string text;
-    bool in_ssml = false;
-    if (req.find("input") != req.end())
+void
+synth_gcloud::release ()
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    _tags--;
+    _cv.notify_all ();
+}
+
+// p95 latency (ms) of ep, or 0 while too few rpcs are known (locked)
+long
+synth_gcloud::p95 (const endpoint& ep) const
+{
+    if (ep.latencies.size () < 20) return 0;
+    std::vector<long> v (ep.latencies);
+    std::vector<long>::iterator it = v.begin () + (v.size () * 95) / 100;
+    std::nth_element (v.begin (), it, v.end ());
+    return *it;
+}
+
+// the endpoint with the fewest rpcs outstanding, among those j has not tried yet;
+// ejected ones are taken only when 'ejected' holds and nothing else is left (locked)
+synth_gcloud::endpoint*
+synth_gcloud::pick (const job& j, bool ejected)
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+    endpoint* best = nullptr;
+    endpoint* fallback = nullptr;
+    for (endpoint& ep : _endpoints)
     {
-        const nlohmann::json input = req["input"];
-        if (req.find("input") != req.end())
-            text = req["text"];
-        else if (req.find("ssml") != req.end())
+        if (ep.stubs.empty ()) continue;
+        if (std::find (j.tried.begin (), j.tried.end (), &ep) != j.tried.end ()) continue;
+        if (now < ep.ejected_until)
         {
-            text = req["ssml"];
-            in_ssml = true;
+            if (!fallback || ep.ejected_until < fallback->ejected_until) fallback = &ep;
+            continue;
         }
+        if (!best || ep.outstanding < best->outstanding) best = &ep;
     }
-    if (text.empty() && req.find("text") != req.end())
+    return best ? best : (ejected ? fallback : nullptr);
+}
+
+// j -> ep (locked)
+void
+synth_gcloud::launch (const job_ptr& j, endpoint* ep, bool hedged)
+{
+    call* c = new call ();
+    c->synth = this;
+    c->j = j;
+    c->ep = ep;
+    c->hedged = hedged;
+    c->t0 = std::chrono::steady_clock::now ();
+    c->context.set_deadline (j->deadline);
+
+    j->calls.push_back (c);
+    j->tried.push_back (ep);
+    ep->outstanding++;
+    ep->requests++;
+    _calls.insert (c);
+    _tags++;
+
+    // channels of ep in turn
+    TextToSpeech::Stub* stub = ep->stubs[ep->rr++ % ep->stubs.size ()].get ();
+    c->reader = stub->PrepareAsyncSynthesizeSpeech (&c->context, j->request, g_cq);
+    c->reader->StartCall ();
+    c->reader->Finish (&c->resp, &c->status, c);
+}
+
+// req -> rpc (non-blocking); reply is called from the poller thread, unless start fails
+int
+synth_gcloud::start (const request& req, reply_t reply)
+{
+    // voice: language_code, name, ssml_gender
+    std::string lang = req.language;
+    if (lang.length() == 2 || lang[2] != '-')
     {
-        text = req["text"];
-        in_ssml = false;
+        if (!lang.compare(0, 2, "ja"))
+            lang = "ja-JP";
+        else 
+            lang = "en-US";
+    }
+    SsmlVoiceGender gender = SsmlVoiceGender::FEMALE;
+    switch (req.gender)
+    {
+    case request::FEMALE: gender = SsmlVoiceGender::FEMALE; break;
+    case request::MALE: gender = SsmlVoiceGender::MALE; break;
+    case request::NEUTRAL: gender = SsmlVoiceGender::NEUTRAL; break;
+    case request::UNSPECIFIED: break;
+    }
+
+    // request (fields are set in place)
+    const job_ptr j = std::make_shared<job> ();
+    SynthesizeSpeechRequest& request = j->request;
+
+    // input: text, ssml
+    if (req.ssml) request.mutable_input()->set_ssml (req.text); else request.mutable_input()->set_text (req.text);
+
+    // voice: langauge & gender
+    VoiceSelectionParams* voice = request.mutable_voice ();
+    voice->set_language_code (lang);
+    if (!req.voice.empty ()) voice->set_name (req.voice);
+    voice->set_ssml_gender (gender);
+
+    // audio_config: audio_encoding, speaking_rate, pitch, volume_gain_db, sample_rate-hertz, effect_profile_id
+    // (only the encoding, for now)
+    request.mutable_audio_config()->set_audio_encoding (AudioEncoding::LINEAR16);
+
+    j->deadline = std::chrono::system_clock::now () + _deadline;
+    j->reply = reply;
+    j->replied = false;
+    j->hedge = nullptr;
+
+    // gRPC call
+    std::call_once (g_cq_once, []()
+        {
+            g_cq = new grpc::CompletionQueue ();
+            std::thread (thread_poll).detach ();
+        });
+
+    std::unique_lock<std::mutex> lock (_mutex);
+    if (_jobs >= _max_jobs)
+    {
+        _throttled++;
+        _cv.wait (lock, [this]() { return _jobs < _max_jobs; });
     }
-    if (text.empty())
+    endpoint* ep = pick (*j, true);
+    if (!ep)
     {
-        syslog (LOG_ERR, "[synth_gcloud::synthesize] input text not specified");
+        syslog (LOG_ERR, "[synthesize] no endpoint available");
         return -1;
     }
+    _jobs++;
+    launch (j, ep, false);
 
-    // voice: language_code, name, ssml_gender
-    std::string lang;
-    std::string gender_str;
-    std::string voicename;
-    if (req.find("voice") != req.end())
+    // hedging timer: p95 latency of ep
+    const long delay = p95 (*ep);
+    if (_hedging && _endpoints.size () > 1 && delay > 0)
     {
-        const nlohmann::json voice = req["voice"];
-        if (voice.is_string())
-            voicename = voice.get<std::string>();
-        else if (voice.is_object())
+        const std::chrono::system_clock::time_point at =
+            std::chrono::system_clock::now () + std::max (std::chrono::milliseconds (delay), _hedge_min);
+        if (at < j->deadline)
         {
-            if (voice.find("languageCode") != voice.end())
-                lang = voice["languageCode"];
-            if (voice.find("name") != voice.end())
-                voicename = voice["name"];
-            if (voice.find("ssmlGender") != voice.end())
-                gender_str = voice["ssmlGender"];
+            timer* t = new timer ();
+            t->synth = this;
+            t->j = j;
+            j->hedge = t;
+            _timers.insert (t);
+            _tags++;
+            t->alarm.Set (g_cq, at, t);
         }
     }
-    if (lang.empty())
-        lang = (req.find("language") != req.end()) ? req["language"].get<std::string>() : "en-US";
-    if (lang.length() < 2)
-        lang = "en-US";
-    else if (lang.length() == 2 || lang[2] != '-')
+
+    return 0;
+}
+
+// the first rpc outlasted the p95 latency -- the request goes to another endpoint as well
+void
+synth_gcloud::hedge (timer* t)
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    _timers.erase (t);
+    job& j = *t->j;
+    if (j.hedge != t) return;
+    j.hedge = nullptr;
+    if (j.replied) return;
+
+    endpoint* ep = pick (j, false);
+    if (!ep) return;
+    syslog (LOG_DEBUG, "[synth_gcloud] hedged to %s", ep->host.c_str());
+    _hedged++;
+    launch (t->j, ep, true);
+}
+
+// (poller thread)
+void
+synth_gcloud::complete (call* c, bool ok)
+{
+    const bool success = ok && c->status.ok ();
+    const job_ptr j = c->j;
+    bool answer = false;
     {
-        if (!lang.compare(0, 2, "ja"))
-            lang = "ja-JP";
-        else 
-            lang = "en-US";
+        std::unique_lock<std::mutex> lock (_mutex);
+        endpoint& ep = *c->ep;
+        ep.outstanding--;
+        _calls.erase (c);
+        j->calls.erase (std::find (j->calls.begin (), j->calls.end (), c));
+        const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+
+        // endpoint health (the losers of hedging, canceled by us, do not count)
+        if (success)
+        {
+            _completed++;
+            const long ms = std::chrono::duration_cast<std::chrono::milliseconds> (now - c->t0).count ();
+            if (ep.latencies.size () < 100) ep.latencies.push_back (ms);
+            else ep.latencies[ep.next] = ms;
+            ep.next = (ep.next + 1) % 100;
+            ep.failures = 0;
+        }
+        else if (!j->replied || c->status.error_code () != grpc::StatusCode::CANCELLED)
+        {
+            // enum grpc::StatusCode (/usr/include/grpcpp/impl/codegen/status_code_enum.h)
+            syslog (LOG_ERR, "[synth_gcloud::synthesize] failure in SynthesizeSpeech: host=%s status=%d (see \"status_code_enum.h\")",
+                    ep.host.c_str(), (int)c->status.error_code());
+            _failed++;
+            ep.errors++;
+            if (c->status.error_code () == grpc::StatusCode::DEADLINE_EXCEEDED) _deadline_exceeded++;
+            if (++ep.failures >= _eject_failures && now >= ep.ejected_until)
+            {
+                syslog (LOG_WARNING, "[synth_gcloud] %s ejected for %ds", ep.host.c_str(), (int)_eject_duration.count ());
+                ep.ejected_until = now + _eject_duration;
+                ep.ejections++;
+                ep.failures = 0;
+            }
+        }
+
+        if (!j->replied)
+        {
+            if (success)
+            {
+                // the first answer wins
+                j->replied = answer = true;
+                if (c->hedged) _hedge_wins++;
+                for (call* other : j->calls) other->context.TryCancel ();
+                if (j->hedge) j->hedge->alarm.Cancel ();
+            }
+            else if (j->calls.empty ())
+            {
+                // failover, while the deadline allows
+                endpoint* next = (std::chrono::system_clock::now () < j->deadline) ? pick (*j, false) : nullptr;
+                if (next)
+                {
+                    _failovers++;
+                    launch (j, next, false);
+                }
+                else
+                {
+                    j->replied = answer = true;
+                    if (j->hedge) j->hedge->alarm.Cancel ();
+                }
+            }
+        }
     }
-    if (gender_str.empty())
-        gender_str = (req.find("gender") != req.end()) ? req["gender"].get<std::string>() : "FEMALE";
-    SsmlVoiceGender gender = SsmlVoiceGender::SSML_VOICE_GENDER_UNSPECIFIED;
-    switch (toupper(gender_str[0]))
+    if (!answer) return;
     {
-    case 'F': gender = SsmlVoiceGender::FEMALE; break;
-    case 'M': gender = SsmlVoiceGender::MALE; break;
-    case 'N': gender = SsmlVoiceGender::NEUTRAL; break;
+        std::unique_lock<std::mutex> lock (_mutex);
+        _jobs--;
+        _cv.notify_all ();
     }
 
-    // audio_config: audio_encoding, speaking_rate, pitch, volume_gain_db, sample_rate-hertz, effect_profile_id
-    AudioEncoding encoding = AudioEncoding::LINEAR16;
-    if (req.find("audioConfig") != req.end())
+    if (!success)
+        j->reply (-1, nullptr);
+    else
     {
-        // not configurable, for now
+        // audio_content (LINEAR16, with a WAV header) is moved into wav, not copied
+        std::string content;
+        content.swap (*c->resp.mutable_audio_content ());
+        syslog (LOG_DEBUG, "[synth_gcloud::synthesize] wave data generated: size=%d", (int)content.size());
+        j->reply (0, std::make_shared<audio> (std::move (content)));
     }
+}
 
-    // request
-    SynthesizeSpeechRequest request;
+synth_gcloud::~synth_gcloud ()
+{
+    // calls complete (as CANCELLED) through the poller
+    std::unique_lock<std::mutex> lock (_mutex);
+    for (call* c : _calls) c->context.TryCancel ();
+    for (timer* t : _timers) t->alarm.Cancel ();
+    _cv.wait (lock, [this]() { return _tags == 0; });
+}
 
-    // input
-    SynthesisInput input;
-    if (in_ssml) input.set_ssml (text); else input.set_text (text);
-    //request.set_allocated_input (&input);
-    SynthesisInput* allocated_input = input.New ();
-    allocated_input->CopyFrom (input);
-    request.set_allocated_input (allocated_input);
+int
+synth_gcloud::synthesize (const request& req, audio_ptr& wav)
+{
+    syslog (LOG_DEBUG, "[synthesize] text=\"%s\"", req.text.c_str());
 
-    // voice: langauge & gender
-    VoiceSelectionParams voice;
-    voice.set_language_code (lang);
-    voice.set_ssml_gender (gender);
-    VoiceSelectionParams* allocated_voice = voice.New ();
-    allocated_voice->CopyFrom (voice);
-    request.set_allocated_voice (allocated_voice);
-
-    // audio_config: encoding
-    AudioConfig config;
-    config.set_audio_encoding (encoding);
-    AudioConfig* allocated_config = config.New ();
-    allocated_config->CopyFrom (config);
-    request.set_allocated_audio_config (allocated_config);
+    std::mutex m;
+    std::condition_variable cv;
+    bool done = false;
+    int err = -1;
+    int rc = start (req, [&](int rslt, const audio_ptr& w)
+        {
+            std::unique_lock<std::mutex> lock (m);
+            err = rslt;
+            wav = w;
+            done = true;
+            cv.notify_one ();
+        });
+    if (rc) return rc;
+
+    std::unique_lock<std::mutex> lock (m);
+    cv.wait (lock, [&done]() { return done; });
+    return err;
+}
 
-    // gRPC call
-    ClientContext context;
-    SynthesizeSpeechResponse resp;
-    Status status = _stub->SynthesizeSpeech (&context, request, &resp);
-    // enum grpc::StatusCode (/usr/include/grpcpp/impl/codegen/status_code_enum.h)
-    if (!status.ok ())
+// the speech is fed to out (samples shared, not copied) from the poller thread
+void
+synth_gcloud::synthesize_async (const request& req, const audio_stream_ptr& out, done_t done)
+{
+    syslog (LOG_DEBUG, "[synthesize_async] text=\"%s\"", req.text.c_str());
+
+    int rc = start (req, [out, done](int rslt, const audio_ptr& wav)
+        {
+            if (rslt) out->close (rslt);
+            else rslt = audio_stream::feed (*out, wav);
+            if (done) done (rslt);
+        });
+    if (rc)
     {
-        syslog (LOG_ERR, "[synth_gcloud::synthesize] failure in SynthesizeSpeech: status=%d (see \"status_code_enum.h\")",
-                (int)status.error_code());
-        return -1;
+        out->close (rc);
+        if (done) done (rc);
     }
+}
 
-    const std::string* content = &resp.audio_content ();
-    len = content->size();
-    //len = content->capacity();
-    bytes = new uint8_t[len];
-    memcpy (bytes, content->c_str(), len);
-    syslog (LOG_ERR, "[synth_gcloud::synthesize] wave data generated: size=%d capacity=%d", content->size(), content->capacity());
+static const char*
+channel_state (grpc_connectivity_state st)
+{
+    switch (st)
+    {
+    case GRPC_CHANNEL_IDLE: return "idle";
+    case GRPC_CHANNEL_CONNECTING: return "connecting";
+    case GRPC_CHANNEL_READY: return "ready";
+    case GRPC_CHANNEL_TRANSIENT_FAILURE: return "transient_failure";
+    case GRPC_CHANNEL_SHUTDOWN: return "shutdown";
+    }
+    return "unknown";
+}
 
-    return 0;
+nlohmann::json
+synth_gcloud::stats () const
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now ();
+
+    nlohmann::json s;
+    s["inflight"] = _calls.size ();
+    s["completed"] = _completed;
+    s["failed"] = _failed;
+    s["deadline_exceeded"] = _deadline_exceeded;
+    s["hedged"] = _hedged;
+    s["hedge_wins"] = _hedge_wins;
+    s["failovers"] = _failovers;
+    s["throttled"] = _throttled;
+    for (const endpoint& ep : _endpoints)
+    {
+        nlohmann::json e;
+        e["outstanding"] = ep.outstanding;
+        e["requests"] = ep.requests;
+        e["errors"] = ep.errors;
+        e["ejections"] = ep.ejections;
+        e["ejected"] = now < ep.ejected_until;
+        e["p95_ms"] = p95 (ep);
+        e["channels"] = nlohmann::json::array ();
+        for (const std::shared_ptr<grpc::Channel>& ch : ep.channels)
+            e["channels"].push_back (channel_state (ch->GetState (false)));
+        s["endpoints"][ep.host] = e;
+    }
+    return s;
 }
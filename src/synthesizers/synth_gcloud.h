@@ -3,6 +3,13 @@
 #ifndef SYNTH_GCLOUD_H
 #define SYNTH_GCLOUD_H
 
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
 #include <nlohmann/json.hpp>
 #include <grpc++/grpc++.h>
 #if 1
@@ -15,20 +22,92 @@ using google::cloud::texttospeech::v1beta1::TextToSpeech;
 
 #include "synthesizer.h"
 
+// client of a TextToSpeech service (google cloud or compatible), backed by one or more endpoints
+// rpcs are asynchronous: many of them can be in flight at once (up to max_inflight), with a deadline each,
+// and their completions are served by a poller thread shared by all the instances.
+// - channels: each endpoint has a pool of channels (connections, kept alive and set up in advance),
+//   over which its rpcs are distributed in turn
+// - balancing: each rpc goes to the endpoint with the fewest rpcs outstanding
+// - hedging: when an rpc outlasts the p95 latency of its endpoint, the request is sent to another
+//   endpoint as well, and whichever answers first wins (the other is canceled)
+// - failover: a failed request is retried at another endpoint while its deadline allows
+// - ejection: an endpoint failing several times in a row is skipped for a while
 class synth_gcloud final: public synthesizer
 {
 public:
+    // spec = {.., host | hosts:[..], credentials, deadline_ms,
+    //         max_inflight, channels:{count, keepalive_s, warmup}, hedge:{enabled, min_ms}, eject:{failures, duration_s}}
     synth_gcloud (const nlohmann::json& spec);
+    ~synth_gcloud ();
 
 public:
-    int synthesize (const nlohmann::json& req, const char* outfile) override;
-    int synthesize (const nlohmann::json& req, uint8_t*& bytes, size_t& len) override;
-    bool synthesizable (const nlohmann::json& req) const override;
+    int synthesize (const request& req, audio_ptr& wav) override;
+    void synthesize_async (const request& req, const audio_stream_ptr& out, done_t done) override;
+    bool synthesizable (const request& req) const override;
+
+    nlohmann::json stats () const;
+
+private:
+    struct tag;
+    struct call;
+    struct timer;
+    struct job;
+    typedef std::shared_ptr<job> job_ptr;
+    typedef std::function<void(int, const audio_ptr&)> reply_t;
+
+    // a backend
+    struct endpoint
+    {
+        std::string host;	// <host>[:<port>]
+        std::vector<std::shared_ptr<grpc::Channel>> channels;
+        std::vector<std::unique_ptr<TextToSpeech::Stub>> stubs;	// one per channel
+        size_t rr;		// next stub (round-robin)
+        int outstanding;	// rpcs in flight
+        std::vector<long> latencies;	// ms of the latest successful rpcs (ring)
+        size_t next;		// next slot in latencies
+        int failures;		// in a row
+        std::chrono::steady_clock::time_point ejected_until;
+
+        // counters
+        uint64_t requests;
+        uint64_t errors;
+        uint64_t ejections;
+    };
+
+    int start (const request& req, reply_t reply);
+    endpoint* pick (const job& j, bool ejected);
+    void launch (const job_ptr& j, endpoint* ep, bool hedged);
+    void complete (call* c, bool ok);
+    void hedge (timer* t);
+    void release ();
+    long p95 (const endpoint& ep) const;
+    static void thread_poll ();
 
 private:
-    std::string _host;
-    std::string _port;
-    std::unique_ptr<TextToSpeech::Stub> _stub;
+    std::vector<endpoint> _endpoints;	// fixed after construction
+    std::chrono::milliseconds _deadline;	// per request
+    int _max_jobs;			// requests in flight at most (callers of start wait beyond it)
+    int _jobs;
+    bool _hedging;
+    std::chrono::milliseconds _hedge_min;	// lower bound of the hedging delay
+    int _eject_failures;
+    std::chrono::seconds _eject_duration;
+
+    // what is pending on the completion queue (canceled upon destruction)
+    std::set<call*> _calls;
+    std::set<timer*> _timers;
+    int _tags;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;	// a tag released, or a request done
+
+    // counters
+    uint64_t _completed;
+    uint64_t _failed;
+    uint64_t _deadline_exceeded;
+    uint64_t _hedged;
+    uint64_t _hedge_wins;
+    uint64_t _failovers;
+    uint64_t _throttled;	// requests that waited for a slot
 };
 
 #endif
@@ -0,0 +1,449 @@
+//
+
+#include "synth_pool.h"
+#include "logger.h"
+
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <thread>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using json = nlohmann::json;
+
+// replies of a worker to a request, as the engine produces the speech: FORMAT, CHUNK.., END
+// the bytes of a chunk follow the message inline if small, or else are passed in shared memory
+// (a memfd holding len bytes, not copied on the way)
+struct message
+{
+    enum type_t { FORMAT, CHUNK, END };
+    int32_t type;
+    int32_t err;	// END: result of the synthesis
+    uint64_t len;	// bytes that follow (FORMAT: a wav_format, CHUNK: pcm)
+};
+
+static const size_t MAX_MESSAGE = 256 * 1024;	// request (json)
+static const size_t MAX_INLINE = 32 * 1024;	// bytes of a chunk passed inline
+
+// --------------------------------------------------------------------------------
+// fd passing
+// --------------------------------------------------------------------------------
+
+static int
+send_with_fd (int sock, const void* data, size_t len, int fd)
+{
+    struct iovec iov = { (void*)data, len };
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    char ctrl[CMSG_SPACE (sizeof (int))];
+    if (fd >= 0)
+    {
+        memset (ctrl, 0, sizeof (ctrl));
+        msg.msg_control = ctrl;
+        msg.msg_controllen = sizeof (ctrl);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN (sizeof (int));
+        memcpy (CMSG_DATA (cmsg), &fd, sizeof (int));
+    }
+
+    ssize_t n;
+    while ((n = sendmsg (sock, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR) ;
+    return (n == (ssize_t)len) ? 0 : -1;
+}
+
+// (fd = -1 if none)
+static int
+recv_with_fd (int sock, void* data, size_t len, int& fd)
+{
+    struct iovec iov = { data, len };
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    char ctrl[CMSG_SPACE (sizeof (int))];
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof (ctrl);
+
+    fd = -1;
+    ssize_t n;
+    while ((n = recvmsg (sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) ;
+    if (n <= 0) return -1;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR (&msg);
+    if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy (&fd, CMSG_DATA (cmsg), sizeof (int));
+    return (int)n;
+}
+
+// --------------------------------------------------------------------------------
+// worker & zygote processes
+// --------------------------------------------------------------------------------
+
+// (worker) one message, with len bytes of data (if any)
+static int
+send_message (int sock, message::type_t type, int err, const void* data, size_t len)
+{
+    const message m = { type, err, len };
+    if (len <= MAX_INLINE)
+    {
+        std::vector<uint8_t> buff (sizeof (m) + len);
+        memcpy (buff.data (), &m, sizeof (m));
+        if (len > 0) memcpy (buff.data () + sizeof (m), data, len);
+        return send_with_fd (sock, buff.data (), buff.size (), -1);
+    }
+
+    // shared memory
+    int fd = memfd_create ("tts_wav", MFD_CLOEXEC);
+    const uint8_t* p = (const uint8_t*)data;
+    size_t left = len;
+    while (fd >= 0 && left > 0)
+    {
+        const ssize_t w = write (fd, p, left);
+        if (w <= 0) { close (fd); fd = -1; break; }
+        p += w;
+        left -= w;
+    }
+    if (fd < 0) return -1;
+    const int rslt = send_with_fd (sock, &m, sizeof (m), fd);
+    close (fd);
+    return rslt;
+}
+
+// (worker) the stream of the engine -> messages, chunk by chunk as they come
+static int
+forward (int sock, audio_stream& out)
+{
+    audio_stream::reader in (out);
+    wav_format fmt;
+    if (in.format (fmt)) return -1;
+    if (send_message (sock, message::FORMAT, 0, &fmt, sizeof (fmt))) _exit (0);	// the server is gone
+
+    audio_ptr pcm;
+    int n;
+    while ((n = in.next (pcm)) > 0)
+        if (send_message (sock, message::CHUNK, 0, pcm->data (), pcm->size ())) _exit (0);
+    return (n < 0) ? -1 : 0;
+}
+
+// request -> engine -> messages (never returns)
+// the engine runs on a thread of its own, while the speech is forwarded as it is produced
+static void
+worker_main (synthesizer* engine, int sock)
+{
+    std::vector<char> buff (MAX_MESSAGE);
+    while (1)
+    {
+        const ssize_t n = recv (sock, buff.data (), buff.size (), 0);
+        if (n <= 0) _exit (0);	// the server is gone
+
+        request req;
+        bool parsed = false;
+        try
+        {
+            parsed = (req.parse (json::parse (std::string (buff.data (), n))) == 0);
+        }
+        catch (...) {}
+
+        int err = -1;
+        if (parsed)
+        {
+            audio_stream out;
+            std::thread t ([engine, &req, &out, &err]() { err = engine->synthesize (req, out); });
+            const int rslt = forward (sock, out);
+            t.join ();
+            if (!err) err = rslt;
+        }
+        if (send_message (sock, message::END, err, nullptr, 0)) _exit (0);
+    }
+}
+
+// forks a worker for each "+" received on ctrl, and passes back its socket and pid;
+// kills and reaps the worker of pid for each "-" + pid (never returns)
+// ** workers are reaped only then: a pid stays theirs (if only as a zombie) until the pool is done with it
+static void
+zygote_main (synthesizer* engine, int ctrl)
+{
+    signal (SIGTERM, SIG_DFL);
+    signal (SIGHUP, SIG_DFL);
+    signal (SIGINT, SIG_IGN);
+
+    char msg[1 + sizeof (pid_t)];
+    ssize_t n;
+    while ((n = recv (ctrl, msg, sizeof (msg), 0)) > 0)
+    {
+        if (msg[0] == '-' && n == (ssize_t)sizeof (msg))
+        {
+            pid_t pid;
+            memcpy (&pid, msg + 1, sizeof (pid));
+            ::kill (pid, SIGKILL);
+            while (waitpid (pid, nullptr, 0) < 0 && errno == EINTR) ;
+            continue;
+        }
+
+        int sv[2];
+        if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+        {
+            send_with_fd (ctrl, "\0\0\0\0", sizeof (pid_t), -1);
+            continue;
+        }
+        const pid_t pid = fork ();
+        if (pid == 0)
+        {
+            close (ctrl);
+            close (sv[0]);
+            worker_main (engine, sv[1]);
+        }
+        close (sv[1]);
+        send_with_fd (ctrl, &pid, sizeof (pid), (pid > 0) ? sv[0] : -1);
+        close (sv[0]);
+    }
+    _exit (0);	// the server is gone
+}
+
+// --------------------------------------------------------------------------------
+// pool
+// --------------------------------------------------------------------------------
+
+bool
+synth_pool::pooled (const json& spec)
+{
+    return spec.find ("processes") != spec.end () && spec["processes"].is_number_integer ()
+        && spec["processes"].get<int>() > 0;
+}
+
+// spec = {.., processes, timeout_s}
+synth_pool::synth_pool (synthesizer* engine, const json& spec)
+    : _engine (engine), _zygote (-1), _zygote_pid (-1), _timeout_s (30), _requests (0), _restarts (0), _affine (0)
+{
+    assert (engine);
+    name = engine->name;
+    this->engine = engine->engine;
+    languages = engine->languages;
+    concurrent = true;
+
+    int nproc = 1;
+    if (spec.find ("processes") != spec.end () && spec["processes"].is_number_integer ())
+        nproc = std::max (spec["processes"].get<int>(), 1);
+    if (spec.find ("timeout_s") != spec.end () && spec["timeout_s"].is_number_integer ())
+        _timeout_s = spec["timeout_s"];
+
+    int sv[2];
+    if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == 0)
+    {
+        _zygote_pid = fork ();
+        if (_zygote_pid == 0)
+        {
+            close (sv[0]);
+            zygote_main (engine, sv[1]);
+        }
+        close (sv[1]);
+        if (_zygote_pid > 0)
+            _zygote = sv[0];
+        else
+            close (sv[0]);
+    }
+    if (_zygote < 0)
+        syslog (LOG_ERR, "[synth_pool] %s: zygote not created: %s", name.c_str(), strerror (errno));
+
+    _workers.resize (nproc, worker { -1, -1, false, std::string () });
+    for (worker& w : _workers) spawn (w);
+    syslog (LOG_NOTICE, "[synth_pool] %s: %d worker processes", name.c_str(), nproc);
+}
+
+synth_pool::~synth_pool ()
+{
+    for (worker& w : _workers) kill (w);
+    if (_zygote >= 0) close (_zygote);  // the zygote exits
+    if (_zygote_pid > 0) waitpid (_zygote_pid, nullptr, 0);
+}
+
+// a new worker, forked by the zygote
+int
+synth_pool::spawn (worker& w)
+{
+    std::unique_lock<std::mutex> lock (_zygote_mutex);
+    if (_zygote < 0) return -1;
+
+    pid_t pid = -1;
+    int fd = -1;
+    if (send (_zygote, "+", 1, MSG_NOSIGNAL) != 1 || recv_with_fd (_zygote, &pid, sizeof (pid), fd) != sizeof (pid) || fd < 0)
+    {
+        syslog (LOG_ERR, "[synth_pool] %s: worker not spawned", name.c_str());
+        if (fd >= 0) close (fd);
+        return -1;
+    }
+
+    // a worker that stalls too long (before the first chunk, or in between) is taken for hung
+    struct timeval tv = { _timeout_s, 0 };
+    setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+
+    w.sock = fd;
+    w.pid = pid;
+    syslog (LOG_INFO, "[synth_pool] %s: worker %d spawned", name.c_str(), pid);
+    return 0;
+}
+
+// by the zygote, which reaps it as well (the pid cannot have been reused by then; see zygote_main)
+void
+synth_pool::kill (worker& w)
+{
+    if (w.sock >= 0) close (w.sock);
+    if (w.pid > 0)
+    {
+        std::unique_lock<std::mutex> lock (_zygote_mutex);
+        char msg[1 + sizeof (pid_t)] = { '-' };
+        memcpy (msg + 1, &w.pid, sizeof (pid_t));
+        if (_zygote >= 0) send (_zygote, msg, sizeof (msg), MSG_NOSIGNAL);
+    }
+    w.sock = -1;
+    w.pid = -1;
+}
+
+int
+synth_pool::synthesize (const request& req, audio_ptr& wav)
+{
+    audio_stream out;
+    int err = synthesize (req, out);
+    if (err) return err;
+
+    wav = out.wav ();
+    return wav ? 0 : -1;
+}
+
+// chunks are passed to out as soon as the worker forwards them
+int
+synth_pool::synthesize (const request& req, audio_stream& out)
+{
+    // an idle worker: one with the same voice, or else one with no voice yet, or else any
+    const std::string voice = req.voice_key ();
+    worker* w = nullptr;
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _cv.wait (lock, [this, &w, &voice]()
+            {
+                w = nullptr;
+                for (worker& x : _workers)
+                {
+                    if (x.busy) continue;
+                    if (x.voice == voice) { w = &x; break; }
+                    if (!w || (x.voice.empty () && !w->voice.empty ())) w = &x;
+                }
+                return w != nullptr;
+            });
+        w->busy = true;
+        _requests++;
+        if (w->voice == voice) _affine++;
+    }
+
+    if (w->sock < 0 && spawn (*w) == 0)
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _restarts++;
+    }
+
+    // request -> worker -> FORMAT, CHUNK.., END
+    int err = -1;
+    const std::string msg = req.dump().dump ();
+    if (w->sock >= 0 && msg.length () <= MAX_MESSAGE && send_with_fd (w->sock, msg.data (), msg.length (), -1) == 0)
+    {
+        std::vector<uint8_t> buff (sizeof (message) + MAX_INLINE);
+        while (1)
+        {
+            int fd = -1;
+            const int n = recv_with_fd (w->sock, buff.data (), buff.size (), fd);
+            message m;
+            if (n >= (int)sizeof (m)) memcpy (&m, buff.data (), sizeof (m));
+            const uint8_t* data = buff.data () + sizeof (m);
+            const size_t inlined = (n >= (int)sizeof (m)) ? n - sizeof (m) : 0;
+
+            if (n < (int)sizeof (m))
+                ;	// lost
+            else if (m.type == message::END)
+            {
+                err = m.err;
+                break;
+            }
+            else if (m.type == message::FORMAT && inlined == sizeof (wav_format))
+            {
+                wav_format fmt;
+                memcpy (&fmt, data, sizeof (fmt));
+                out.open (fmt);
+                continue;
+            }
+            else if (m.type == message::CHUNK && fd < 0 && inlined == m.len)
+            {
+                out.write (data, m.len);	// copied
+                continue;
+            }
+            else if (m.type == message::CHUNK && fd >= 0 && m.len > 0)
+            {
+                // shared memory -> chunk (no copy; unmapped along with the last reference)
+                void* p = mmap (nullptr, m.len, PROT_READ, MAP_SHARED, fd, 0);
+                close (fd);
+                if (p != MAP_FAILED)
+                {
+                    const size_t len = m.len;
+                    std::shared_ptr<const void> owner (p, [len](const void* q) { munmap ((void*)q, len); });
+                    out.write (std::make_shared<audio> ((const uint8_t*)p, len, owner));
+                    continue;
+                }
+            }
+            if (fd >= 0) close (fd);
+
+            // crashed, hung, or out of protocol -- replaced upon the next request
+            syslog (LOG_ERR, "[synth_pool] %s: worker %d lost (%s)", name.c_str(), w->pid, (n < 0) ? strerror (errno) : "bad message");
+            kill (*w);
+            err = -1;
+            break;
+        }
+    }
+    else if (w->sock >= 0 && msg.length () <= MAX_MESSAGE)
+    {
+        syslog (LOG_ERR, "[synth_pool] %s: worker %d lost (%s)", name.c_str(), w->pid, strerror (errno));
+        kill (*w);
+    }
+    out.close (err);
+
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        w->busy = false;
+        w->voice = (w->sock >= 0) ? voice : std::string ();
+    }
+    _cv.notify_one ();
+
+    return err;
+}
+
+bool
+synth_pool::synthesizable (const request& req) const
+{
+    return _engine->synthesizable (req);
+}
+
+json
+synth_pool::stats () const
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+
+    json s;
+    int busy = 0;
+    for (const worker& w : _workers) if (w.busy) busy++;
+    s["processes"] = _workers.size ();
+    s["busy"] = busy;
+    s["requests"] = _requests;
+    s["restarts"] = _restarts;
+    s["voice_affine"] = _affine;
+    return s;
+}
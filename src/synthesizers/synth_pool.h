@@ -0,0 +1,68 @@
+//
+
+#ifndef TTS_SYNTH_POOL_H
+#define TTS_SYNTH_POOL_H
+
+#include "synthesizer.h"
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <nlohmann/json.hpp>
+
+// a synthesizer run by worker processes, for engines with process-global state (espeak, festival)
+// each worker has its own copy of the engine, forked from a "zygote" process which is created
+// along with the pool (before any thread is started), and keeps creating workers on demand.
+// requests go to an idle worker over a socket; the speech comes back chunk by chunk as the engine
+// produces it (small chunks inline, large ones in shared memory (memfd)), so that playback starts early.
+// a worker that crashes or hangs is killed, and replaced upon the next request.
+// requests go preferably to a worker which served the same voice last (its engine has it loaded).
+class synth_pool final : public synthesizer
+{
+public:
+    // engine: used only in the worker processes from now on
+    synth_pool (synthesizer* engine, const nlohmann::json& spec);
+    ~synth_pool ();
+
+    // whether the synthesizer of spec is to be run by worker processes ("processes" > 0)
+    static bool pooled (const nlohmann::json& spec);
+
+public:
+    int synthesize (const request& req, audio_ptr& wav) override;
+    int synthesize (const request& req, audio_stream& out) override;
+    bool synthesizable (const request& req) const override;
+
+    nlohmann::json stats () const;
+
+private:
+    struct worker
+    {
+        int sock;	// -1: to be (re)spawned
+        pid_t pid;
+        bool busy;
+        std::string voice;	// request::voice_key of the last request
+    };
+
+    int spawn (worker& w);
+    void kill (worker& w);
+
+private:
+    synthesizer* _engine;
+    int _zygote;		// control socket to the zygote
+    pid_t _zygote_pid;
+    std::mutex _zygote_mutex;
+
+    std::vector<worker> _workers;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;	// a worker became idle
+    int _timeout_s;		// per request
+
+    // counters
+    uint64_t _requests;
+    uint64_t _restarts;
+    uint64_t _affine;		// requests served by a worker with the same voice
+};
+
+#endif
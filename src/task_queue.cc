@@ -0,0 +1,252 @@
+//
+
+#include "task_queue.h"
+#include "logger.h"
+
+#include <cassert>
+#include <cstring>
+#include <string>
+
+static const char* lane_names[task_queue::NPRIORITY] = { "high", "normal", "low" };
+
+task_queue::task_queue (size_t capacity, overflow_policy policy)
+    : _capacity (capacity), _policy (policy), _starvation (0),
+      _queued (0), _dropped_oldest (0), _dropped_newest (0), _rejected (0), _peak (0), _internal_total (0)
+{
+    memset (_waits, 0, sizeof (_waits));
+}
+
+// conf = {"capacity": 64, "overflow": "drop-oldest" | "drop-newest" | "reject", "starvation_ms": 5000}
+int
+task_queue::configure (const nlohmann::json& conf)
+{
+    syslog (LOG_NOTICE, "[task_queue] %s", conf.dump().c_str());
+    if (!conf.is_object ()) return -1;
+
+    std::unique_lock<std::mutex> lock (_mutex);
+
+    // capacity
+    if (conf.find ("capacity") != conf.end ())
+    {
+        const nlohmann::json cap = conf["capacity"];
+        if (!cap.is_number_integer () || cap.get<int>() < 0)
+        {
+            syslog (LOG_ERR, "[task_queue] invalid capacity: %s", cap.dump().c_str());
+            return -1;
+        }
+        _capacity = cap.get<size_t>();
+    }
+
+    // overflow policy
+    if (conf.find ("overflow") != conf.end ())
+    {
+        const std::string policy = conf["overflow"];
+        if (!policy.compare ("drop-oldest"))
+            _policy = DROP_OLDEST;
+        else if (!policy.compare ("drop-newest"))
+            _policy = DROP_NEWEST;
+        else if (!policy.compare ("reject"))
+            _policy = REJECT;
+        else
+        {
+            syslog (LOG_ERR, "[task_queue] unknown overflow policy: %s", policy.c_str());
+            return -1;
+        }
+    }
+
+    // starvation protection for lower lanes
+    if (conf.find ("starvation_ms") != conf.end ())
+    {
+        const nlohmann::json ms = conf["starvation_ms"];
+        if (!ms.is_number_integer () || ms.get<int>() < 0)
+        {
+            syslog (LOG_ERR, "[task_queue] invalid starvation_ms: %s", ms.dump().c_str());
+            return -1;
+        }
+        _starvation = std::chrono::milliseconds (ms.get<int>());
+    }
+
+    return 0;
+}
+
+int
+task_queue::priority_of (const nlohmann::json& prio)
+{
+    if (prio.is_number_integer ())
+    {
+        const int p = prio;
+        if (p >= 0 && p < NPRIORITY) return p;
+    }
+    else if (prio.is_string ())
+    {
+        const std::string p = prio;
+        for (int i = 0; i < NPRIORITY; i++)
+            if (!p.compare (lane_names[i])) return i;
+    }
+
+    syslog (LOG_WARNING, "[task_queue] unknown priority: %s", prio.dump().c_str());
+    return NORMAL;
+}
+
+// total #tasks (to be called with _mutex held)
+size_t
+task_queue::depth () const
+{
+    size_t n = 0;
+    for (const std::deque<entry>& lane : _lanes) n += lane.size ();
+    return n;
+}
+
+// the highest non-empty lane, unless some lane has been kept waiting longer than _starvation
+// (to be called with _mutex held)
+int
+task_queue::lane_to_serve (clock_t::time_point now) const
+{
+    int lane = -1;
+    for (int i = 0; i < NPRIORITY; i++)
+    {
+        if (_lanes[i].empty ()) continue;
+        lane = i;
+        break;
+    }
+    if (lane < 0 || _starvation.count () == 0) return lane;
+
+    // the most starved among the lower lanes
+    clock_t::time_point oldest = now - _starvation;
+    for (int i = lane + 1; i < NPRIORITY; i++)
+    {
+        if (_lanes[i].empty ()) continue;
+        if (_lanes[i].front().t > oldest) continue;
+        oldest = _lanes[i].front().t;
+        lane = i;
+    }
+    return lane;
+}
+
+int
+task_queue::push (const task_t& task, int prio, const std::function<void()>& on_drop)
+{
+    assert (0 <= prio && prio < NPRIORITY);
+
+    entry dropped;  // destroyed (and notified) outside the lock
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+
+        if (_capacity > 0 && depth () >= _capacity)
+        {
+            // victim of DROP_OLDEST: the oldest one in the lowest non-empty lane
+            int victim = NPRIORITY - 1;
+            while (_lanes[victim].empty ()) victim--;
+
+            switch (_policy)
+            {
+            case DROP_OLDEST:
+                // never drop a more urgent task in favor of the new one
+                if (victim >= prio)
+                {
+                    dropped = _lanes[victim].front();
+                    _lanes[victim].pop_front ();
+                    _dropped_oldest++;
+                    syslog (LOG_WARNING, "[task_queue] full (%d): oldest %s task dropped",
+                            (int)_capacity, lane_names[victim]);
+                    break;
+                }
+                // fall through
+            case DROP_NEWEST:
+                _dropped_newest++;
+                syslog (LOG_WARNING, "[task_queue] full (%d): new %s task dropped",
+                        (int)_capacity, lane_names[prio]);
+                return DROPPED;
+            case REJECT:
+                _rejected++;
+                syslog (LOG_WARNING, "[task_queue] full (%d): new %s task rejected",
+                        (int)_capacity, lane_names[prio]);
+                return REJECTED;
+            }
+        }
+
+        _lanes[prio].push_back (entry { task, clock_t::now (), on_drop });
+        _queued++;
+        const size_t n = depth ();
+        if (n > _peak) _peak = n;
+    }
+    _cv.notify_one ();  // wakes up one of the waiting workers
+    if (dropped.on_drop) dropped.on_drop ();
+
+    return QUEUED;
+}
+
+void
+task_queue::push_internal (const task_t& task)
+{
+    {
+        std::unique_lock<std::mutex> lock (_mutex);
+        _internal.push_back (task);
+        _internal_total++;
+    }
+    _cv.notify_one ();
+}
+
+// blocking -- waits until a task becomes available
+int
+task_queue::pop (task_t& task)
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+    _cv.wait (lock, [this]() { return !_internal.empty () || depth () > 0; });
+
+    // internal tasks first (their requests are being served already)
+    if (!_internal.empty ())
+    {
+        task = _internal.front ();
+        _internal.pop_front ();
+        return 0;
+    }
+
+    const clock_t::time_point now = clock_t::now ();
+    const int lane = lane_to_serve (now);
+    assert (lane >= 0);
+
+    // queue-wait
+    wait_stats& w = _waits[lane];
+    const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds> (now - _lanes[lane].front().t).count ();
+    w.count++;
+    w.total_us += us;
+    if (us > w.max_us) w.max_us = us;
+    for (int i = 0; i < lane; i++)
+        if (!_lanes[i].empty ()) { w.promoted++; break; }
+
+    task = _lanes[lane].front().task;
+    _lanes[lane].pop_front ();
+
+    return 0;
+}
+
+nlohmann::json
+task_queue::stats () const
+{
+    std::unique_lock<std::mutex> lock (_mutex);
+
+    nlohmann::json s;
+    s["capacity"] = _capacity;
+    s["depth"] = depth ();
+    s["peak"] = _peak;
+    s["queued"] = _queued;
+    s["dropped_oldest"] = _dropped_oldest;
+    s["dropped_newest"] = _dropped_newest;
+    s["rejected"] = _rejected;
+    s["internal"] = { {"depth", _internal.size ()}, {"queued", _internal_total} };
+
+    // per lane
+    for (int i = 0; i < NPRIORITY; i++)
+    {
+        const wait_stats& w = _waits[i];
+        nlohmann::json l;
+        l["depth"] = _lanes[i].size ();
+        l["dequeued"] = w.count;
+        l["wait_avg_us"] = w.count ? w.total_us / w.count : 0;
+        l["wait_max_us"] = w.max_us;
+        l["promoted"] = w.promoted;
+        s["lanes"][lane_names[i]] = l;
+    }
+    return s;
+}
@@ -0,0 +1,95 @@
+//
+
+#ifndef TTS_TASK_QUEUE_H
+#define TTS_TASK_QUEUE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <nlohmann/json.hpp>
+
+// bounded queue of tasks, shared between listeners (producers) and workers (consumers)
+// tasks are kept in one lane per priority; higher lanes are served first.
+class task_queue
+{
+public:
+    typedef std::function<int(void)> task_t;
+    typedef std::chrono::steady_clock clock_t;
+
+    // what to do with a task that arrives when the queue is full
+    enum overflow_policy
+    {
+        DROP_OLDEST,	// discard the oldest task of the lowest lane, and accept the new one
+        DROP_NEWEST,	// discard the new task silently
+        REJECT		// discard the new task, and let the producer know
+    };
+
+    // results of push
+    enum { QUEUED = 0, DROPPED = 1, REJECTED = -1 };
+
+    // priorities (= lane indices)
+    enum priority { HIGH = 0, NORMAL = 1, LOW = 2, NPRIORITY = 3 };
+
+public:
+    task_queue (size_t capacity = 0, overflow_policy policy = DROP_OLDEST);
+
+    // conf = {capacity, overflow, starvation_ms}
+    int configure (const nlohmann::json& conf);
+
+    // non-blocking; on_drop is called if the task is evicted later on (DROP_OLDEST)
+    int push (const task_t& task, int prio = NORMAL, const std::function<void()>& on_drop = nullptr);
+    int pop (task_t& task);				// blocking
+
+    // work on behalf of a task already admitted (e.g. helpers of a split request):
+    // unbounded, served ahead of the lanes, and not counted in the stats of the lanes
+    void push_internal (const task_t& task);
+
+    nlohmann::json stats () const;
+
+    // "high" | "normal" | "low" | 0..2 -> priority (NORMAL for anything else)
+    static int priority_of (const nlohmann::json& prio);
+
+private:
+    struct entry
+    {
+        task_t task;
+        clock_t::time_point t;	// when queued
+        std::function<void()> on_drop;
+    };
+
+    size_t depth () const;
+    int lane_to_serve (clock_t::time_point now) const;
+
+private:
+    size_t _capacity;		// 0 = unbounded
+    overflow_policy _policy;
+    std::chrono::milliseconds _starvation;	// max wait before a lower lane is served first (0 = none)
+
+    std::deque<entry> _lanes[NPRIORITY];
+    std::deque<task_t> _internal;
+    mutable std::mutex _mutex;
+    std::condition_variable _cv;
+
+    // counters
+    uint64_t _queued;
+    uint64_t _dropped_oldest;
+    uint64_t _dropped_newest;
+    uint64_t _rejected;
+    size_t _peak;
+    uint64_t _internal_total;
+
+    // queue-wait per lane
+    struct wait_stats
+    {
+        uint64_t count;
+        uint64_t total_us;
+        uint64_t max_us;
+        uint64_t promoted;	// served ahead of higher lanes due to starvation
+    } _waits[NPRIORITY];
+};
+
+#endif
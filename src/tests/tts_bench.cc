@@ -0,0 +1,257 @@
+//
+// micro-benchmarks of the request path outside the engines
+// usage: tts_bench [iterations]
+
+#include "task_queue.h"
+#include "request.h"
+#include "audio_cache.h"
+#include "route_table.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+typedef std::chrono::steady_clock clock_type;
+
+static void
+report (const char* name, int n, clock_type::time_point t0)
+{
+    const double ns = std::chrono::duration_cast<std::chrono::nanoseconds> (clock_type::now () - t0).count ();
+    printf ("%-36s %10.1f ns/op  (%d ops)\n", name, ns / n, n);
+}
+
+static volatile size_t g_sink;	// keeps results alive
+
+// push -> an idle worker runs the task (user-001)
+static void
+bench_dispatch (int n)
+{
+    task_queue q;
+    std::atomic<bool> quit (false);
+    std::thread worker ([&q, &quit]()
+        {
+            task_queue::task_t task;
+            while (!quit)
+            {
+                q.pop (task);
+                task ();
+            }
+        });
+
+    std::vector<long> us;
+    for (int i = 0; i < n; i++)
+    {
+        std::this_thread::sleep_for (std::chrono::microseconds (500));  // the worker is idle again
+        std::atomic<bool> ran (false);
+        clock_type::time_point served;
+        const clock_type::time_point t0 = clock_type::now ();
+        q.push ([&ran, &served]() { served = clock_type::now (); ran = true; return 0; });
+        while (!ran) std::this_thread::yield ();
+        us.push_back (std::chrono::duration_cast<std::chrono::microseconds> (served - t0).count ());
+    }
+    quit = true;
+    q.push ([]() { return 0; });
+    worker.join ();
+
+    std::sort (us.begin (), us.end ());
+    printf ("%-36s median %ldus, p99 %ldus, max %ldus  (%d ops)\n", "dispatch to an idle worker",
+            us[n / 2], us[n * 99 / 100], us.back (), n);
+}
+
+// push + pop over the three lanes, in one thread (uncontended) (user-003)
+static void
+bench_task_queue (int n)
+{
+    task_queue q;
+    const task_queue::task_t task = []() { return 0; };
+    task_queue::task_t t;
+
+    clock_type::time_point t0 = clock_type::now ();
+    for (int i = 0; i < n; i++)
+    {
+        q.push (task, i % task_queue::NPRIORITY);
+        q.pop (t);
+    }
+    report ("task_queue push+pop", n, t0);
+
+    // 64 deep
+    t0 = clock_type::now ();
+    for (int i = 0; i < n; i += 64)
+    {
+        for (int j = 0; j < 64; j++) q.push (task, j % task_queue::NPRIORITY);
+        for (int j = 0; j < 64; j++) q.pop (t);
+    }
+    report ("task_queue push+pop (64 deep)", n, t0);
+}
+
+// 4 producers, 4 workers
+static void
+bench_task_queue_mt (int n)
+{
+    const int nthread = 4;
+    task_queue q;
+    std::atomic<int> done (0);
+    const task_queue::task_t task = [&done]() { done++; return 0; };
+
+    clock_type::time_point t0 = clock_type::now ();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < nthread; i++)
+        threads.push_back (std::thread ([&q, &task, n, i]()
+            {
+                for (int j = 0; j < n / nthread; j++) q.push (task, (i + j) % task_queue::NPRIORITY);
+            }));
+    for (int i = 0; i < nthread; i++)
+        threads.push_back (std::thread ([&q, &done, n]()
+            {
+                task_queue::task_t t;
+                while (done < n / nthread * nthread)
+                {
+                    q.pop (t);
+                    t ();
+                }
+            }));
+    for (int i = 0; i < nthread; i++) threads[i].join ();
+    while (done < n / nthread * nthread) std::this_thread::yield ();
+    report ("task_queue 4x4 threads", n, t0);
+
+    // wakes up the workers left waiting
+    for (int i = 0; i < nthread; i++) q.push_internal ([]() { return 0; });
+    for (int i = nthread; i < 2 * nthread; i++) threads[i].join ();
+}
+
+// json -> request, and its cache key (user-004)
+static void
+bench_request (int n)
+{
+    const nlohmann::json j = { {"text", "The quick brown fox jumps over the lazy dog.  It was 3.14 meters away!  "
+                                        "Was it?  Nobody knows,\nbut the dog did not move an inch.  The end."},
+                               {"language", "en-US"}, {"gender", "FEMALE"}, {"rate", 180}, {"priority", "high"} };
+    request req;
+
+    clock_type::time_point t0 = clock_type::now ();
+    for (int i = 0; i < n; i++)
+    {
+        request r;
+        g_sink = r.parse (j);
+    }
+    report ("request::parse", n, t0);
+
+    req.parse (j);
+    t0 = clock_type::now ();
+    for (int i = 0; i < n; i++) g_sink = req.key ().size ();
+    report ("request::key (150 chars)", n, t0);
+
+    // (user-008)
+    t0 = clock_type::now ();
+    for (int i = 0; i < n; i++) g_sink = req.sentences ().size ();
+    report ("request::sentences (5 sentences)", n, t0);
+}
+
+// ----------------------------------------
+// routing (user-005): route_table::find vs the linear scan it replaced
+// ----------------------------------------
+
+class synth_fake: public synthesizer
+{
+public:
+    synth_fake (const std::string& n, const std::string& eng, const std::list<std::string>& langs)
+    {
+        name = n;
+        engine = eng;
+        languages = langs;
+    }
+    int synthesize (const request&, audio_ptr&) override { return -1; }
+    bool synthesizable (const request& req) const override
+    {
+        return engine_compliant (req.engine) && language_supported (req.language);
+    }
+};
+
+static void
+bench_routes (int n)
+{
+    // 8 synthesizers, 3 languages each
+    const char* langs[] = { "en", "fr", "es", "de", "it", "ja", "ko", "zh", "pt", "nl" };
+    std::list<synth_fake> fakes;
+    std::list<synthesizer*> synths;
+    for (int i = 0; i < 8; i++)
+    {
+        fakes.emplace_back ("s" + std::to_string (i), (i % 2) ? "festival" : "espeak",
+                            std::list<std::string> { langs[i], langs[i + 1], langs[i + 2] });
+        synths.push_back (&fakes.back ());
+    }
+    route_table routes;
+    routes.build (synths);
+
+    request first, last, named;
+    first.parse ({ {"text", "x"}, {"language", "en-US"} });	// served by the first synthesizer
+    last.parse ({ {"text", "x"}, {"language", "nl"} });		// by the last one
+    named.parse ({ {"text", "x"}, {"language", "zh"}, {"synthesizer", "s7"}, {"host", "h"} });	// memoized
+
+    struct { const char* name; const request& req; } cases[] = {
+        { "first", first }, { "last", last }, { "named, host (memo)", named } };
+    for (const auto& c : cases)
+    {
+        char label[64];
+        clock_type::time_point t0 = clock_type::now ();
+        for (int i = 0; i < n; i++) g_sink = (size_t)routes.scan (c.req);
+        snprintf (label, sizeof (label), "routing scan: %s", c.name);
+        report (label, n, t0);
+
+        t0 = clock_type::now ();
+        for (int i = 0; i < n; i++) g_sink = (size_t)routes.find (c.req);
+        snprintf (label, sizeof (label), "routing find: %s", c.name);
+        report (label, n, t0);
+    }
+}
+
+// (user-009)
+static void
+bench_audio_cache (int n)
+{
+    const int nkey = 1000;
+    std::vector<std::string> keys;
+    for (int i = 0; i < nkey; i++) keys.push_back ("T" + std::to_string (i) + std::string (64, 'x'));
+    const audio_ptr wav = std::make_shared<audio> (std::vector<uint8_t> (1024, 0));
+
+    // every key fits
+    audio_cache c (nkey * 1024);
+    for (const std::string& k : keys) c.insert (k, wav);
+    clock_type::time_point t0 = clock_type::now ();
+    for (int i = 0; i < n; i++) g_sink = c.find (keys[i % nkey])->size ();
+    report ("audio_cache find (hit)", n, t0);
+
+    // half of them fit: every insert evicts
+    audio_cache half (nkey / 2 * 1024);
+    t0 = clock_type::now ();
+    for (int i = 0; i < n; i++) half.insert (keys[i % nkey], wav);
+    report ("audio_cache insert (evicting)", n, t0);
+}
+
+int
+main (int argc, char** argv)
+{
+    const int n = (argc > 1) ? atoi (argv[1]) : 1000000;
+    if (n <= 0) return 1;
+
+    bench_dispatch (std::min (n, 2000));
+    bench_task_queue (n);
+    bench_task_queue_mt (n);
+    bench_request (n / 10);
+    bench_routes (n / 10);
+    bench_audio_cache (n);
+
+    return 0;
+}
+
+// no logs
+void
+_syslog (int /*prio*/, const char* /*fmt*/, ...)
+{
+}
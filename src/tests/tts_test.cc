@@ -0,0 +1,488 @@
+//
+// checks of the parts that need no engine nor sink
+// usage: tts_test [-v]  (exit status = #failures)
+
+#include "task_queue.h"
+#include "request.h"
+#include "audio_cache.h"
+#include "audio_stream.h"
+#include "disk_cache.h"
+#include "route_table.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+typedef std::chrono::steady_clock clock_type;
+
+static bool g_verbose = false;
+static int g_checks = 0;
+static int g_failures = 0;
+
+#define CHECK(cond) check ((cond), #cond, __FILE__, __LINE__)
+
+static void
+check (bool ok, const char* expr, const char* file, int line)
+{
+    g_checks++;
+    if (ok) return;
+    g_failures++;
+    fprintf (stderr, "%s:%d: failed: %s\n", file, line, expr);
+}
+
+// ----------------------------------------
+// dispatch (user-001)
+// ----------------------------------------
+
+// an idle worker (blocked in pop) is woken up by push, instead of finding the task on its next poll
+static void
+test_dispatch_wakeup ()
+{
+    task_queue q;
+    std::atomic<bool> quit (false);
+    std::thread worker ([&q, &quit]()
+        {
+            task_queue::task_t task;
+            while (!quit)
+            {
+                q.pop (task);
+                task ();
+            }
+        });
+
+    std::vector<long> us;
+    for (int i = 0; i < 50; i++)
+    {
+        std::this_thread::sleep_for (std::chrono::milliseconds (2));  // the worker is idle again
+        std::atomic<bool> ran (false);
+        clock_type::time_point served;
+        const clock_type::time_point t0 = clock_type::now ();
+        q.push ([&ran, &served]() { served = clock_type::now (); ran = true; return 0; });
+        while (!ran) std::this_thread::yield ();
+        us.push_back (std::chrono::duration_cast<std::chrono::microseconds> (served - t0).count ());
+    }
+    quit = true;
+    q.push ([]() { return 0; });
+    worker.join ();
+
+    // far below the 100 ms period of the polling loop it replaced (50 ms on average)
+    std::sort (us.begin (), us.end ());
+    if (g_verbose) fprintf (stderr, "wake-up: median %ldus, max %ldus\n", us[us.size () / 2], us.back ());
+    CHECK (us[us.size () / 2] < 10000);
+}
+
+// ----------------------------------------
+// bounded queue (user-002)
+// ----------------------------------------
+
+// a task that appends its tag to log
+static task_queue::task_t
+tagged (std::vector<int>& log, int tag)
+{
+    return [&log, tag]() { log.push_back (tag); return 0; };
+}
+
+// runs every queued task (in the order served)
+static void
+drain (task_queue& q)
+{
+    while (q.stats ()["depth"].get<size_t>() > 0 || q.stats ()["internal"]["depth"].get<size_t>() > 0)
+    {
+        task_queue::task_t task;
+        q.pop (task);
+        task ();
+    }
+}
+
+static void
+test_task_queue_overflow ()
+{
+    // drop-oldest: the oldest of the lowest lane goes, never a more urgent one
+    {
+        task_queue q (2, task_queue::DROP_OLDEST);
+        std::vector<int> log;
+        int dropped = 0;
+        CHECK (q.push (tagged (log, 1), task_queue::LOW, [&dropped]() { dropped = 1; }) == task_queue::QUEUED);
+        CHECK (q.push (tagged (log, 2), task_queue::HIGH) == task_queue::QUEUED);
+        CHECK (q.push (tagged (log, 3), task_queue::NORMAL) == task_queue::QUEUED);
+        CHECK (dropped == 1);
+        CHECK (q.push (tagged (log, 4), task_queue::LOW) == task_queue::DROPPED);
+        drain (q);
+        CHECK ((log == std::vector<int> { 2, 3 }));
+        CHECK (q.stats ()["dropped_oldest"] == 1);
+        CHECK (q.stats ()["dropped_newest"] == 1);
+    }
+
+    // drop-newest, reject
+    {
+        task_queue q (1, task_queue::DROP_NEWEST);
+        std::vector<int> log;
+        CHECK (q.push (tagged (log, 1)) == task_queue::QUEUED);
+        CHECK (q.push (tagged (log, 2), task_queue::HIGH) == task_queue::DROPPED);
+        q.push_internal (tagged (log, 3));  // not bounded
+        drain (q);
+        CHECK ((log == std::vector<int> { 3, 1 }));
+    }
+    {
+        task_queue q;
+        CHECK (q.configure ({ {"capacity", 1}, {"overflow", "reject"} }) == 0);
+        CHECK (q.configure ({ {"overflow", "ignore"} }) == -1);
+        CHECK (q.configure ({ {"capacity", -1} }) == -1);
+        std::vector<int> log;
+        CHECK (q.push (tagged (log, 1)) == task_queue::QUEUED);
+        CHECK (q.push (tagged (log, 2)) == task_queue::REJECTED);
+        CHECK (q.stats ()["rejected"] == 1);
+        CHECK (q.stats ()["peak"] == 1);
+    }
+}
+
+// ----------------------------------------
+// priority lanes (user-003)
+// ----------------------------------------
+
+static void
+test_task_queue_lanes ()
+{
+    task_queue q;
+    std::vector<int> log;
+    q.push (tagged (log, 1), task_queue::LOW);
+    q.push (tagged (log, 2), task_queue::NORMAL);
+    q.push (tagged (log, 3), task_queue::HIGH);
+    q.push (tagged (log, 4), task_queue::NORMAL);
+    q.push_internal (tagged (log, 5));
+    drain (q);
+    CHECK ((log == std::vector<int> { 5, 3, 2, 4, 1 }));
+
+    CHECK (task_queue::priority_of ("high") == task_queue::HIGH);
+    CHECK (task_queue::priority_of (2) == task_queue::LOW);
+    CHECK (task_queue::priority_of ("urgent") == task_queue::NORMAL);
+}
+
+static void
+test_task_queue_starvation ()
+{
+    task_queue q;
+    CHECK (q.configure ({ {"starvation_ms", 20} }) == 0);
+    std::vector<int> log;
+    q.push (tagged (log, 1), task_queue::LOW);
+    std::this_thread::sleep_for (std::chrono::milliseconds (30));
+    q.push (tagged (log, 2), task_queue::HIGH);
+    q.push (tagged (log, 3), task_queue::LOW);
+    drain (q);
+    // the low task kept waiting is promoted; the fresh one is not
+    CHECK ((log == std::vector<int> { 1, 2, 3 }));
+    CHECK (q.stats ()["lanes"]["low"]["promoted"] == 1);
+}
+
+// ----------------------------------------
+// typed requests (user-004)
+// ----------------------------------------
+
+static request
+parsed (const nlohmann::json& j)
+{
+    request req;
+    CHECK (req.parse (j) == 0);
+    return req;
+}
+
+static void
+test_request_parse ()
+{
+    const request req = parsed ({ {"input", { {"text", "Hi"} }}, {"voice", { {"languageCode", "fr-FR"}, {"ssmlGender", "FEMALE"} }},
+                                  {"rate", 180}, {"priority", "high"}, {"sinks", {"a", "b"}} });
+    CHECK (req.text == "Hi" && !req.ssml);
+    CHECK (req.language == "fr-FR" && req.lang2 () == "fr");
+    CHECK (req.gender == request::FEMALE);
+    CHECK (req.rate == 180 && req.pitch == -1);
+    CHECK (req.priority == task_queue::HIGH);
+    CHECK (req.sinks_specified && req.sink_names.size () == 2);
+
+    // dump -> parse reproduces what synthesizers look at
+    request copy;
+    CHECK (copy.parse (req.dump ()) == 0);
+    CHECK (copy.key () == req.key ());
+
+    request bad;
+    CHECK (bad.parse ({ {"language", "en"} }) == -1);
+    CHECK (bad.parse ({ {"text", "x"}, {"pitch", 101} }) == -1);
+    CHECK (bad.parse ({ {"text", "x"}, {"language", "e"} }) == -1);
+    CHECK (bad.parse ({ {"text", "x"}, {"sinks", "a"} }) == -1);
+    CHECK (bad.parse ("text") == -1);
+}
+
+static void
+test_request_key ()
+{
+    const std::string k = parsed ({ {"text", "Hello   world"} }).key ();
+    CHECK (k == parsed ({ {"text", "  Hello world \n"} }).key ());
+    CHECK (k != parsed ({ {"text", "Hello world"}, {"language", "fr"} }).key ());
+    CHECK (k != parsed ({ {"text", "Hello world"}, {"rate", 200} }).key ());
+    CHECK (k != parsed ({ {"text", "Hello world"}, {"gender", "FEMALE"} }).key ());
+    CHECK (k != parsed ({ {"ssml", "Hello world"} }).key ());
+    // delivery options do not change the speech
+    CHECK (k == parsed ({ {"text", "Hello world"}, {"priority", "high"}, {"split", true}, {"sinks", {"a"}} }).key ());
+}
+
+// ----------------------------------------
+// routing (user-005)
+// ----------------------------------------
+
+// a synthesizer that is only looked at
+class synth_fake: public synthesizer
+{
+public:
+    synth_fake (const std::string& n, const std::string& eng, const std::list<std::string>& langs)
+    {
+        name = n;
+        engine = eng;
+        languages = langs;
+    }
+    int synthesize (const request&, audio_ptr&) override { return -1; }
+    bool synthesizable (const request& req) const override
+    {
+        return engine_compliant (req.engine) && language_supported (req.language);
+    }
+};
+
+static void
+test_route_table ()
+{
+    synth_fake a ("a", "espeak", { "en", "fr" }), b ("b", "festival", { "en", "es" }), c ("c", "google", { "ja", "en" });
+    route_table routes (2);
+    routes.build ({ &a, &b, &c });
+
+    const nlohmann::json reqs[] = {
+        { {"text", "x"} },
+        { {"text", "x"}, {"language", "es-ES"} },
+        { {"text", "x"}, {"language", "ja"}, {"engine", "any"} },
+        { {"text", "x"}, {"engine", "fest"} },
+        { {"text", "x"}, {"synthesizer", "c"} },
+        { {"text", "x"}, {"synthesizer", "c"}, {"language", "fr"} },
+        { {"text", "x"}, {"host", "h"}, {"language", "fr"} },
+        { {"text", "x"}, {"language", "de"} },
+    };
+    synthesizer* const expected[] = { &a, &b, &c, &b, &c, nullptr, &a, nullptr };
+    for (int pass = 0; pass < 2; pass++)  // the second one from the memo
+        for (size_t i = 0; i < sizeof (reqs) / sizeof (reqs[0]); i++)
+        {
+            const request req = parsed (reqs[i]);
+            CHECK (routes.scan (req) == expected[i]);
+            CHECK (routes.find (req) == expected[i]);
+        }
+}
+
+// ----------------------------------------
+// wav headers (user-006)
+// ----------------------------------------
+
+static void
+append (std::vector<uint8_t>& v, const char* id, const std::vector<uint8_t>& body)
+{
+    v.insert (v.end (), id, id + 4);
+    const uint32_t n = body.size ();
+    for (int i = 0; i < 4; i++) v.push_back ((n >> (8 * i)) & 0xff);
+    v.insert (v.end (), body.begin (), body.end ());
+    if (n & 1) v.push_back (0);
+}
+
+static void
+test_wav_chunks ()
+{
+    const wav_format fmt = { 22050, 1, 16 };
+    uint8_t hd[WAV_HEADER_SIZE];
+    wav_header (hd, fmt, 4);
+
+    // LIST (odd size, padded) before an 18-byte fmt
+    std::vector<uint8_t> wav (hd, hd + 12);
+    append (wav, "LIST", { 'I', 'N', 'F', 'O', 'x' });
+    std::vector<uint8_t> f (hd + 20, hd + 36);
+    f.push_back (0);
+    f.push_back (0);
+    append (wav, "fmt ", f);
+    append (wav, "data", { 1, 2, 3, 4 });
+
+    wav_format got;
+    size_t offset = 0, datalen = 0;
+    CHECK (wav_parse (wav.data (), wav.size (), got, &offset, &datalen) == 0);
+    CHECK (got.rate == 22050 && got.channels == 1 && got.bits == 16);
+    CHECK (offset == wav.size () - 4 && datalen == 4);
+
+    // only the samples are fed
+    audio_stream_ptr s = audio_stream::of (std::make_shared<audio> (std::vector<uint8_t> (wav)));
+    audio_stream::reader r (*s);
+    audio_ptr pcm;
+    CHECK (r.next (pcm) == 1 && pcm->size () == 4 && pcm->data ()[0] == 1);
+    CHECK (r.next (pcm) == 0);
+
+    // canonical, and broken
+    std::vector<uint8_t> canonical (hd, hd + WAV_HEADER_SIZE);
+    canonical.resize (WAV_HEADER_SIZE + 4);
+    CHECK (wav_parse (canonical.data (), canonical.size (), got, &offset, &datalen) == 0);
+    CHECK (offset == WAV_HEADER_SIZE && datalen == 4);
+    CHECK (wav_parse (wav.data (), 40, got) == -1);		// truncated
+    std::vector<uint8_t> nofmt (hd, hd + 12);
+    append (nofmt, "data", { 1, 2 });
+    CHECK (wav_parse (nofmt.data (), nofmt.size (), got) == -1);
+}
+
+// ----------------------------------------
+// sentence splitting (user-008)
+// ----------------------------------------
+
+static void
+test_request_sentences ()
+{
+    std::vector<request> segs = parsed ({ {"text", " Hello.  Pi is 3.14! Is it?\nyes "}, {"split", true}, {"rate", 180} }).sentences ();
+    CHECK (segs.size () == 4);
+    if (segs.size () == 4)
+    {
+        CHECK (segs[0].text == "Hello.");
+        CHECK (segs[1].text == "Pi is 3.14!");
+        CHECK (segs[2].text == "Is it?");
+        CHECK (segs[3].text == "yes");
+        CHECK (!segs[0].split && segs[0].rate == 180);
+    }
+
+    // "。" "！"
+    segs = parsed ({ {"text", "\xe3\x81\x82\xe3\x80\x82\xe3\x81\x84\xef\xbc\x81"}, {"language", "ja"} }).sentences ();
+    CHECK (segs.size () == 2);
+
+    // ssml: as is
+    CHECK (parsed ({ {"ssml", "<speak>One. Two.</speak>"} }).sentences ().size () == 1);
+    // no terminator, or nothing but terminators
+    CHECK (parsed ({ {"text", "no terminator"} }).sentences ().size () == 1);
+    CHECK (parsed ({ {"text", " . "} }).sentences ().size () == 1);
+}
+
+// ----------------------------------------
+// memory cache (user-009)
+// ----------------------------------------
+
+static audio_ptr
+bytes (size_t n)
+{
+    return std::make_shared<audio> (std::vector<uint8_t> (n, 0));
+}
+
+static void
+test_audio_cache_lru ()
+{
+    audio_cache c (300);
+    c.insert ("a", bytes (100));
+    c.insert ("b", bytes (100));
+    c.insert ("c", bytes (100));
+    CHECK (c.find ("a") != nullptr);  // a: most recently used
+    c.insert ("d", bytes (100));	// evicts b
+    CHECK (c.find ("b") == nullptr);
+    CHECK (c.find ("a") && c.find ("c") && c.find ("d"));
+
+    c.insert ("e", bytes (250));	// evicts a, c and d
+    CHECK (!c.find ("a") && !c.find ("c") && !c.find ("d") && c.find ("e"));
+    c.insert ("f", bytes (301));	// too large: ignored
+    CHECK (!c.find ("f") && c.find ("e"));
+
+    // replacement
+    c.insert ("e", bytes (10));
+    CHECK (c.find ("e")->size () == 10);
+    const nlohmann::json s = c.stats ();
+    CHECK (s["size"] == 10);
+    CHECK (s["entries"] == 1);
+    CHECK (s["evictions"] == 4);
+
+    // disabled, configured
+    audio_cache off;
+    off.insert ("a", bytes (1));
+    CHECK (!off.enabled () && !off.find ("a"));
+    CHECK (off.configure ({ {"memory_mb", 1} }) == 0 && off.enabled ());
+    CHECK (off.configure ({ {"memory_mb", "1"} }) == -1);
+}
+
+// ----------------------------------------
+// disk cache (user-010)
+// ----------------------------------------
+
+static void
+test_disk_cache ()
+{
+    char dir[] = "/tmp/tts_test.XXXXXX";
+    if (!mkdtemp (dir)) { CHECK (!"mkdtemp"); return; }
+    const nlohmann::json conf = { {"directory", dir}, {"disk_mb", 1}, {"segment_mb", 0.5} };
+    const std::string d (dir);
+    {
+        disk_cache c;
+        CHECK (c.configure (conf) == 0);
+        CHECK (c.insert ("a", bytes (1000)) == 0);
+        CHECK (c.insert ("b", bytes (1000)) == 0);
+        CHECK (c.insert ("a", bytes (1000)) == 0);	// already there: not recorded twice
+        CHECK (c.stats ()["size"] == 2000);
+    }
+
+    // the data of b altered: its record is dropped at startup
+    int fd = open ((d + "/seg.0").c_str (), O_WRONLY);
+    CHECK (fd >= 0 && pwrite (fd, "x", 1, 1500) == 1);
+    close (fd);
+    {
+        disk_cache c;
+        CHECK (c.configure (conf) == 0);
+        CHECK (c.find ("a") && c.find ("a")->size () == 1000);
+        CHECK (!c.find ("b"));
+        CHECK (c.stats ()["entries"] == 1 && c.stats ()["size"] == 1000);
+    }
+
+    // segment ids are not reused, even when the segments are gone
+    unlink ((d + "/seg.0").c_str ());
+    {
+        disk_cache c;
+        CHECK (c.configure (conf) == 0);
+        CHECK (!c.find ("a"));
+        CHECK (c.insert ("c", bytes (10)) == 0);
+        CHECK (access ((d + "/seg.1").c_str (), F_OK) == 0);
+    }
+    for (const char* f : { "/index", "/seg.1" }) unlink ((d + f).c_str ());
+    rmdir (dir);
+}
+
+int
+main (int argc, char** argv)
+{
+    g_verbose = (argc > 1 && !strcmp (argv[1], "-v"));
+
+    test_dispatch_wakeup ();
+    test_task_queue_overflow ();
+    test_task_queue_lanes ();
+    test_task_queue_starvation ();
+    test_request_parse ();
+    test_request_key ();
+    test_route_table ();
+    test_wav_chunks ();
+    test_request_sentences ();
+    test_audio_cache_lru ();
+    test_disk_cache ();
+
+    printf ("%d checks, %d failure(s)\n", g_checks, g_failures);
+    return g_failures;
+}
+
+// logs go to stderr with -v, nowhere otherwise
+void
+_syslog (int /*prio*/, const char* fmt, ...)
+{
+    if (!g_verbose) return;
+
+    va_list ap;
+    va_start (ap, fmt);
+    vfprintf (stderr, fmt, ap);
+    fprintf (stderr, "\n");
+    va_end (ap);
+}